@@ -0,0 +1,10 @@
+#include "ofMain.h"
+#include "ofApp.h"
+#include "ofAppNoWindow.h"
+
+// Runs without a window or GL context, the culling is CPU only.
+int main() {
+    ofAppNoWindow window;
+    ofSetupOpenGL(&window, 1280, 720, OF_WINDOW);
+    ofRunApp(new ofApp());
+}
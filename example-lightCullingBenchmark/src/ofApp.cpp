@@ -0,0 +1,70 @@
+#include "ofApp.h"
+
+using namespace ofxDeferred;
+
+static double elapsedMicros(uint64_t start, int iterations) {
+    return double(ofGetElapsedTimeMicros() - start) / iterations;
+}
+
+void ofApp::setup() {
+    ofSeedRandom(1234);
+    cam.setNearClip(1.0);
+    cam.setFarClip(5000.0);
+    cam.setPosition(0, 0, 1500);
+    cam.lookAt(ofVec3f(0, 0, 0));
+    projection = cam.getProjectionMatrix(ofRectangle(0, 0, 1280, 720));
+    modelView = cam.getModelViewMatrix();
+    
+    cout << "simd: " << (LightCuller::isSimdEnabled() ? "on" : "off") << endl;
+    cout << "lights\taos transform (us)\tsoa gather (us)\tsoa scalar cull (us)\tsoa simd cull (us)\tvisible" << endl;
+    runBenchmark(1000, 1000);
+    runBenchmark(10000, 200);
+    runBenchmark(100000, 50);
+    ofExit();
+}
+
+void ofApp::runBenchmark(int numLights, int iterations) {
+    vector<DeferredLight> lights(numLights);
+    for (DeferredLight& light : lights) {
+        light.position = ofVec3f(ofRandom(-3000, 3000), ofRandom(-3000, 3000), ofRandom(-3000, 3000));
+        light.radius = ofRandom(50, 200);
+    }
+    
+    // what DeferredLightingPass used to do every frame for every light
+    vector<ofVec3f> viewPositions(numLights);
+    uint64_t start = ofGetElapsedTimeMicros();
+    for (int n = 0; n < iterations; ++n) {
+        for (int i = 0; i < numLights; ++i) {
+            viewPositions[i] = lights[i].position * modelView;
+        }
+    }
+    double aos = elapsedMicros(start, iterations);
+    
+    LightCuller culler;
+    start = ofGetElapsedTimeMicros();
+    for (int n = 0; n < iterations; ++n) {
+        culler.resize(numLights);
+        for (int i = 0; i < numLights; ++i) {
+            culler.set(i, lights[i].position, lights[i].radius);
+        }
+    }
+    double gather = elapsedMicros(start, iterations);
+    
+    start = ofGetElapsedTimeMicros();
+    for (int n = 0; n < iterations; ++n) {
+        culler.cullScalar(modelView, projection);
+    }
+    double scalar = elapsedMicros(start, iterations);
+    size_t scalarVisible = culler.getVisible().size();
+    
+    start = ofGetElapsedTimeMicros();
+    for (int n = 0; n < iterations; ++n) {
+        culler.cull(modelView, projection);
+    }
+    double simd = elapsedMicros(start, iterations);
+    
+    if (culler.getVisible().size() != scalarVisible) {
+        ofLogError("lightCullingBenchmark") << "scalar and simd cull disagree: " << scalarVisible << " vs " << culler.getVisible().size();
+    }
+    cout << numLights << "\t" << aos << "\t" << gather << "\t" << scalar << "\t" << simd << "\t" << culler.getVisible().size() << endl;
+}
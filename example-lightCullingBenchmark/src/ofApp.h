@@ -0,0 +1,18 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDeferredProcessing.h"
+
+// Microbenchmark of DeferredLightingPass light preparation:
+// AoS transform (the old per-light path) vs. SoA scalar / SIMD transform + frustum cull.
+class ofApp : public ofBaseApp {
+public:
+    void setup();
+    
+private:
+    void runBenchmark(int numLights, int iterations);
+    
+    ofCamera cam;
+    ofMatrix4x4 projection;
+    ofMatrix4x4 modelView;
+};
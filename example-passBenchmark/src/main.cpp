@@ -0,0 +1,19 @@
+#include "ofMain.h"
+#include "ofApp.h"
+
+// usage: example-passBenchmark [output.json]
+//
+// The window is never shown, the passes render into their own FBOs.
+// On machines without a GPU run it on Mesa llvmpipe, e.g.
+//   LIBGL_ALWAYS_SOFTWARE=1 xvfb-run -a ./example-passBenchmark results.json
+int main(int argc, char* argv[]) {
+    ofGLFWWindowSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.visible = false;
+    settings.setGLVersion(2, 1);
+    ofCreateWindow(settings);
+
+    string outputPath = argc > 1 ? argv[1] : "benchmark.json";
+    ofRunApp(new ofApp(outputPath));
+}
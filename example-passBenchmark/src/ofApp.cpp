@@ -0,0 +1,260 @@
+#include "ofApp.h"
+
+using namespace ofxDeferred;
+
+static const int WARMUP_FRAMES = 10;
+static const int MEASURE_FRAMES = 60;
+// give up on a case if the timings never come back
+static const int MAX_FRAMES = WARMUP_FRAMES + MEASURE_FRAMES * 4;
+
+static string modeName(DeferredLightingPass::Mode mode) {
+    switch (mode) {
+        case DeferredLightingPass::MODE_SINGLE_PASS: return "single_pass";
+        case DeferredLightingPass::MODE_PER_LIGHT: return "per_light";
+        case DeferredLightingPass::MODE_LIGHT_VOLUME: return "light_volume";
+        case DeferredLightingPass::MODE_TILED: return "tiled";
+    }
+    return "";
+}
+
+static string glString(GLenum name) {
+    const GLubyte* str = glGetString(name);
+    return str ? string((const char*)str) : "";
+}
+
+static string jsonString(const string& str) {
+    string escaped = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+void ofApp::setup() {
+    ofSetVerticalSync(false);
+    ofSetFrameRate(0);
+    ofSeedRandom(1234);
+
+    cam.setNearClip(1.0);
+    cam.setFarClip(3000.0);
+
+    // a field of boxes at different depths, so dof has something to blur
+    for (int i = 0; i < 400; ++i) {
+        SpinningBox box;
+        box.size = ofRandom(20, 80);
+        box.color = ofFloatColor(ofRandom(0.2, 1.0), ofRandom(0.2, 1.0), ofRandom(0.2, 1.0));
+        box.axis = ofVec3f(ofRandomf(), ofRandomf(), ofRandomf()).getNormalized();
+        box.setPosition(ofRandom(-800, 800), ofRandom(-400, 400), ofRandom(-1500, 500));
+        box.flush();
+        boxes.push_back(box);
+    }
+
+    lights.resize(1024);
+    for (DeferredLight& light : lights) {
+        light.position = ofVec3f(ofRandom(-900, 900), ofRandom(-500, 500), ofRandom(-1600, 600));
+        light.diffuseColor = ofFloatColor(ofRandom(0.5, 1.0), ofRandom(0.5, 1.0), ofRandom(0.5, 1.0));
+        light.specularColor = ofFloatColor(1.0, 1.0, 1.0);
+        light.radius = ofRandom(100, 300);
+        light.intensity = 0.5;
+    }
+
+    const int resolutions[][2] = { {1280, 720}, {1920, 1080}, {3840, 2160} };
+    for (const auto& resolution : resolutions) {
+        int w = resolution[0];
+        int h = resolution[1];
+        addLightingCases(w, h);
+
+        const float fStops[] = { 1.4, 4.0, 16.0 };
+        const DofPass::Resolution dofResolutions[] = { DofPass::RESOLUTION_FULL, DofPass::RESOLUTION_HALF, DofPass::RESOLUTION_QUARTER };
+        for (DofPass::Resolution resolution : dofResolutions) {
+            for (float fStop : fStops) {
+                Case c = { "dof", w, h, 0, DeferredLightingPass::MODE_SINGLE_PASS, fStop, 0, resolution, true };
+                cases.push_back(c);
+            }
+        }
+
+        const int Ss[] = { 5, 9, 15 };
+        for (int S : Ss) {
+            Case c = { "motion_blur", w, h, 0, DeferredLightingPass::MODE_SINGLE_PASS, 0, S, DofPass::RESOLUTION_FULL, true };
+            cases.push_back(c);
+        }
+
+        // color grade and vignette, drawn one by one and fused into one shader
+        for (bool fusion : { false, true }) {
+            Case c = { "pointwise", w, h, 0, DeferredLightingPass::MODE_SINGLE_PASS, 0, 0, DofPass::RESOLUTION_FULL, fusion };
+            cases.push_back(c);
+        }
+    }
+
+    currentCase = 0;
+    setupCase(cases[currentCase]);
+}
+
+void ofApp::addLightingCases(int width, int height) {
+    const int numLights[] = { 16, 128, 1024 };
+    const DeferredLightingPass::Mode modes[] = { DeferredLightingPass::MODE_SINGLE_PASS, DeferredLightingPass::MODE_TILED };
+    for (DeferredLightingPass::Mode mode : modes) {
+        for (int n : numLights) {
+            Case c = { "lighting", width, height, n, mode, 0, 0, DofPass::RESOLUTION_FULL, true };
+            cases.push_back(c);
+        }
+    }
+}
+
+void ofApp::setupCase(const Case& c) {
+    // passes are sized at creation, so every case gets a fresh processor
+    processor = ofxDeferredProcessing::Ptr(new ofxDeferredProcessing());
+    processor->init(c.width, c.height);
+    // the passes start from the g buffer albedo, so the boxes are only drawn once
+    processor->setInputSource(ofxDeferredProcessing::INPUT_ALBEDO);
+    processor->setProfilingEnabled(true);
+    processor->getProfilerRef().setWindowSize(MEASURE_FRAMES);
+    processor->setFusionEnabled(c.fusion);
+    passNames.clear();
+
+    if (c.pass == "lighting") {
+        DeferredLightingPass::Ptr pass = processor->createPass<DeferredLightingPass>();
+        pass->setMode(c.lightingMode);
+        for (int i = 0; i < c.numLights; ++i) {
+            pass->addLight(lights[i]);
+        }
+        passNames.push_back(pass->getName());
+    } else if (c.pass == "dof") {
+        DofPass::Ptr pass = processor->createPass<DofPass>();
+        pass->setFocalDepth(1000.f);
+        pass->setFStop(c.fStop);
+        pass->setResolution(c.dofResolution);
+        passNames.push_back(pass->getName());
+    } else if (c.pass == "motion_blur") {
+        MotionBlurPass::Ptr pass = processor->createPass<MotionBlurPass>();
+        pass->settings.S = c.S;
+        passNames.push_back(pass->getName());
+    } else if (c.pass == "pointwise") {
+        ColorGradePass::Ptr colorGrade = processor->createPass<ColorGradePass>();
+        colorGrade->setContrast(1.2f);
+        colorGrade->setSaturation(0.8f);
+        VignettePass::Ptr vignette = processor->createPass<VignettePass>();
+        if (c.fusion) {
+            // Processor names the fused draw after its passes
+            passNames.push_back(colorGrade->getName() + "+" + vignette->getName());
+        } else {
+            passNames.push_back(colorGrade->getName());
+            passNames.push_back(vignette->getName());
+        }
+    }
+    caseFrame = 0;
+}
+
+void ofApp::update() {
+    if (currentCase >= cases.size()) return;
+    const Case& c = cases[currentCase];
+    // the warm up starts once the pass shaders are compiled
+    if (processor->isReady()) {
+        ++caseFrame;
+    }
+
+    // the camera orbits and the boxes spin, so every frame has motion
+    float angle = ofGetFrameNum() * 0.5f;
+    cam.setPosition(1200 * sin(ofDegToRad(angle)), 200, 1200 * cos(ofDegToRad(angle)));
+    cam.lookAt(ofVec3f(0, 0, -500));
+    for (SpinningBox& box : boxes) {
+        box.rotate(2.f, box.axis);
+    }
+
+    Profiler& profiler = processor->getProfilerRef();
+    if (caseFrame == WARMUP_FRAMES) {
+        profiler.clear();
+    }
+    if (caseFrame > WARMUP_FRAMES) {
+        Profiler::Stats stats = getCaseStats();
+        if (stats.numSamples >= MEASURE_FRAMES || caseFrame >= MAX_FRAMES) {
+            finishCase(c);
+            if (++currentCase < cases.size()) {
+                setupCase(cases[currentCase]);
+            } else {
+                writeResults();
+                ofExit();
+            }
+        }
+    }
+}
+
+void ofApp::draw() {
+    if (currentCase >= cases.size()) return;
+
+    processor->beginGbuffer(cam);
+    for (SpinningBox& box : boxes) {
+        box.drawToGBuffer();
+    }
+    processor->endGbuffer();
+
+    processor->begin(cam);
+    processor->end(false);
+}
+
+Profiler::Stats ofApp::getCaseStats() const {
+    Profiler::Stats sum;
+    for (int i = 0; i < passNames.size(); ++i) {
+        Profiler::Stats stats = processor->getPassStats(passNames[i]);
+        sum.cpuMin += stats.cpuMin;
+        sum.cpuAvg += stats.cpuAvg;
+        sum.cpuMax += stats.cpuMax;
+        sum.gpuMin += stats.gpuMin;
+        sum.gpuAvg += stats.gpuAvg;
+        sum.gpuMax += stats.gpuMax;
+        // every draw needs its frames
+        sum.numSamples = i == 0 ? stats.numSamples : min(sum.numSamples, stats.numSamples);
+    }
+    return sum;
+}
+
+void ofApp::finishCase(const Case& c) {
+    Profiler& profiler = processor->getProfilerRef();
+    Profiler::Stats stats = getCaseStats();
+    Profiler::Stats gbufferStats = profiler.getStats("GBuffer");
+
+    stringstream ss;
+    ss << "{\"pass\":" << jsonString(c.pass)
+       << ",\"width\":" << c.width << ",\"height\":" << c.height;
+    if (c.pass == "lighting") {
+        ss << ",\"lights\":" << c.numLights << ",\"mode\":" << jsonString(modeName(c.lightingMode));
+    } else if (c.pass == "dof") {
+        ss << ",\"fStop\":" << c.fStop << ",\"resolutionDivisor\":" << c.dofResolution;
+    } else if (c.pass == "motion_blur") {
+        ss << ",\"S\":" << c.S;
+    } else if (c.pass == "pointwise") {
+        ss << ",\"fusion\":" << (c.fusion ? "true" : "false");
+    }
+    ss << ",\"frames\":" << stats.numSamples
+       << ",\"cpuMs\":{\"min\":" << stats.cpuMin << ",\"avg\":" << stats.cpuAvg << ",\"max\":" << stats.cpuMax << "}";
+    if (profiler.isGpuTimerAvailable()) {
+        ss << ",\"gpuMs\":{\"min\":" << stats.gpuMin << ",\"avg\":" << stats.gpuAvg << ",\"max\":" << stats.gpuMax << "}"
+           << ",\"gbufferGpuMs\":" << gbufferStats.gpuAvg;
+    } else {
+        ss << ",\"gpuMs\":null,\"gbufferGpuMs\":null";
+    }
+    ss << "}";
+    results.push_back(ss.str());
+
+    ofLogNotice("passBenchmark") << results.back();
+}
+
+void ofApp::writeResults() {
+    ofstream file(ofToDataPath(outputPath).c_str());
+    if (!file) {
+        ofLogError("passBenchmark") << "could not open " << outputPath;
+        return;
+    }
+    file << "{" << endl;
+    file << "\"renderer\":" << jsonString(glString(GL_RENDERER)) << "," << endl;
+    file << "\"version\":" << jsonString(glString(GL_VERSION)) << "," << endl;
+    file << "\"simdLightCulling\":" << (LightCuller::isSimdEnabled() ? "true" : "false") << "," << endl;
+    file << "\"warmupFrames\":" << WARMUP_FRAMES << "," << endl;
+    file << "\"results\":[" << endl;
+    for (int i = 0; i < results.size(); ++i) {
+        file << results[i] << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    file << "]}" << endl;
+    ofLogNotice("passBenchmark") << "wrote " << results.size() << " results to " << outputPath;
+}
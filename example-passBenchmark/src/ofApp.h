@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDeferredProcessing.h"
+
+// Times every RenderPass on a synthetic G-buffer across resolutions and pass settings
+// and writes the per pass CPU / GPU times as JSON, one case after another.
+class ofApp : public ofBaseApp {
+public:
+    ofApp(const string& outputPath) : outputPath(outputPath) {}
+
+    void setup();
+    void update();
+    void draw();
+
+private:
+    struct Case {
+        string pass;
+        int width, height;
+        int numLights;
+        ofxDeferred::DeferredLightingPass::Mode lightingMode;
+        float fStop;
+        int S;
+        ofxDeferred::DofPass::Resolution dofResolution;
+        bool fusion;
+    };
+
+    // a box that spins, so the velocity buffer is not only camera motion
+    class SpinningBox : public ofxDeferred::GBufferObject {
+    public:
+        float size;
+        ofFloatColor color;
+        ofVec3f axis;
+    protected:
+        void customDraw() {
+            ofSetColor(color);
+            ofDrawBox(size);
+        }
+    };
+
+    void addLightingCases(int width, int height);
+    void setupCase(const Case& c);
+    // of the passes of the case, summed
+    ofxDeferred::Profiler::Stats getCaseStats() const;
+    void finishCase(const Case& c);
+    void writeResults();
+
+    string outputPath;
+    vector<Case> cases;
+    int currentCase;
+    int caseFrame;
+    vector<string> results;
+
+    ofxDeferredProcessing::Ptr processor;
+    // Profiler names of the case, one per draw
+    vector<string> passNames;
+    ofCamera cam;
+    vector<SpinningBox> boxes;
+    vector<ofxDeferred::DeferredLight> lights;
+};
@@ -0,0 +1,172 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "CameraData.h"
+
+using namespace DeferredEffect;
+
+// std140 layout of the block, in the order of getShaderSource()
+struct CameraBlock {
+    float projection[16];
+    float inverseProjection[16];
+    float modelView[16];
+    float inverseModelView[16];
+    float modelViewProjection[16];
+    float inverseModelViewProjection[16];
+    float prevModelViewProjection[16];
+    float viewport[4];
+    float clip[2];
+    float padding[2];
+    float jitter[4];
+};
+
+CameraData::CameraData() : nearClip(1.0f), farClip(1000.0f), vFlipped(false), frameNum(numeric_limits<uint64_t>::max()), cutPending(false), cutCount(0), buffer(0), dirty(true)
+{
+}
+
+void CameraData::update(ofCamera& cam, const ofRectangle& viewport)
+{
+    // update camera matrices
+    cam.begin();
+    cam.end();
+
+    bool newFrame = frameNum != ofGetFrameNum();
+    bool firstFrame = frameNum == numeric_limits<uint64_t>::max() || cutPending;
+    if (cutPending) {
+        cutPending = false;
+        ++cutCount;
+    }
+    if (newFrame && !firstFrame) {
+        prevModelViewProjection = modelViewProjection;
+        prevJitterNdc = jitterNdc;
+    }
+
+    this->viewport = viewport;
+    // a translation after the projection moves every depth by the same pixels,
+    // rows go down the screen
+    jitterNdc = ofVec2f(2 * jitter.x / viewport.width, -2 * jitter.y / viewport.height);
+    projection = cam.getProjectionMatrix(viewport) * ofMatrix4x4::newTranslationMatrix(ofVec3f(jitterNdc.x, jitterNdc.y, 0));
+    modelView = cam.getModelViewMatrix();
+    modelViewProjection = modelView * projection;
+    inverseProjection = projection.getInverse();
+    inverseModelView = modelView.getInverse();
+    inverseModelViewProjection = modelViewProjection.getInverse();
+    nearClip = cam.getNearClip();
+    farClip = cam.getFarClip();
+    vFlipped = cam.isVFlipped();
+
+    // nothing moved before the first frame of a shot
+    if (firstFrame) {
+        prevModelViewProjection = modelViewProjection;
+        prevJitterNdc = jitterNdc;
+    }
+    frameNum = ofGetFrameNum();
+    dirty = true;
+}
+
+// the extension the block needs, empty with plain uniforms
+string CameraData::getShaderHeader()
+{
+    return isBufferAvailable() ? "#extension GL_ARB_uniform_buffer_object : enable\n" : "";
+}
+
+string CameraData::getShaderSource()
+{
+    static const char* members[] = {
+        "mat4 u_cameraProjection",
+        "mat4 u_cameraInverseProjection",
+        "mat4 u_cameraModelView",
+        "mat4 u_cameraInverseModelView",
+        "mat4 u_cameraModelViewProjection",
+        "mat4 u_cameraInverseModelViewProjection",
+        "mat4 u_cameraPrevModelViewProjection",
+        "vec4 u_cameraViewport",
+        "vec2 u_cameraClip",
+        "vec4 u_cameraJitter"
+    };
+    bool useBuffer = isBufferAvailable();
+    stringstream ss;
+    if (useBuffer) {
+        ss << "layout(std140) uniform CameraData {" << endl;
+    }
+    for (auto member : members) {
+        ss << (useBuffer ? "    " : "uniform ") << member << ";" << endl;
+    }
+    if (useBuffer) {
+        ss << "};" << endl;
+    }
+    return ss.str();
+}
+
+void CameraData::bind(ofShader& shader)
+{
+    if (!isBufferAvailable()) {
+        shader.setUniformMatrix4f("u_cameraProjection", projection);
+        shader.setUniformMatrix4f("u_cameraInverseProjection", inverseProjection);
+        shader.setUniformMatrix4f("u_cameraModelView", modelView);
+        shader.setUniformMatrix4f("u_cameraInverseModelView", inverseModelView);
+        shader.setUniformMatrix4f("u_cameraModelViewProjection", modelViewProjection);
+        shader.setUniformMatrix4f("u_cameraInverseModelViewProjection", inverseModelViewProjection);
+        shader.setUniformMatrix4f("u_cameraPrevModelViewProjection", prevModelViewProjection);
+        shader.setUniform4f("u_cameraViewport", viewport.x, viewport.y, viewport.width, viewport.height);
+        shader.setUniform2f("u_cameraClip", nearClip, farClip);
+        shader.setUniform4f("u_cameraJitter", jitterNdc.x, jitterNdc.y, prevJitterNdc.x, prevJitterNdc.y);
+        return;
+    }
+
+    if (dirty) {
+        upload();
+    }
+    // a relinked program is back at binding 0, so this is set on every bind
+    GLuint program = shader.getProgram();
+    GLuint index = glGetUniformBlockIndex(program, "CameraData");
+    if (index == GL_INVALID_INDEX) return;
+    glUniformBlockBinding(program, index, BINDING);
+    glBindBufferBase(GL_UNIFORM_BUFFER, BINDING, buffer);
+}
+
+void CameraData::upload()
+{
+    CameraBlock block;
+    memcpy(block.projection, projection.getPtr(), sizeof(block.projection));
+    memcpy(block.inverseProjection, inverseProjection.getPtr(), sizeof(block.inverseProjection));
+    memcpy(block.modelView, modelView.getPtr(), sizeof(block.modelView));
+    memcpy(block.inverseModelView, inverseModelView.getPtr(), sizeof(block.inverseModelView));
+    memcpy(block.modelViewProjection, modelViewProjection.getPtr(), sizeof(block.modelViewProjection));
+    memcpy(block.inverseModelViewProjection, inverseModelViewProjection.getPtr(), sizeof(block.inverseModelViewProjection));
+    memcpy(block.prevModelViewProjection, prevModelViewProjection.getPtr(), sizeof(block.prevModelViewProjection));
+    block.viewport[0] = viewport.x;
+    block.viewport[1] = viewport.y;
+    block.viewport[2] = viewport.width;
+    block.viewport[3] = viewport.height;
+    block.clip[0] = nearClip;
+    block.clip[1] = farClip;
+    block.padding[0] = block.padding[1] = 0;
+    block.jitter[0] = jitterNdc.x;
+    block.jitter[1] = jitterNdc.y;
+    block.jitter[2] = prevJitterNdc.x;
+    block.jitter[3] = prevJitterNdc.y;
+
+    if (!buffer) {
+        glGenBuffers(1, &buffer);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(block), &block, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    dirty = false;
+}
+
+void CameraData::clear()
+{
+    if (buffer) {
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+    dirty = true;
+}
+
+bool CameraData::isBufferAvailable()
+{
+    return GLEW_ARB_uniform_buffer_object;
+}
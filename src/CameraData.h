@@ -0,0 +1,90 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // The camera of a frame as the shaders see it : the matrices, their inverses,
+    // the clip planes, the viewport and the model view projection of the frame
+    // before. Processor computes it once per frame for the g buffer and all passes.
+    // With ARB_uniform_buffer_object it is one std140 uniform block, bind() only
+    // attaches the buffer then, otherwise it sets the same names as uniforms.
+    class CameraData {
+    public:
+        // uniform buffer binding point of the CameraData block
+        static const int BINDING = 0;
+
+        CameraData();
+        ~CameraData() { clear(); }
+
+        // the matrices of cam for viewport. The model view projection of the last
+        // update() of an earlier frame becomes the previous one.
+        void update(ofCamera& cam, const ofRectangle& viewport);
+        // ofGetFrameNum() of the last update()
+        uint64_t getFrameNum() const { return frameNum; }
+        // the next update() starts a new shot, nothing moved before it. Passes
+        // keeping a history drop it when getCutCount() changes.
+        void cut() { cutPending = true; }
+        // cut() calls the updates so far started a shot for
+        unsigned getCutCount() const { return cutCount; }
+        
+        // sub-pixel offset of the projection from the next update() on, in pixels
+        // along the rows and columns of the targets, see Processor::setJitterEnabled()
+        void setJitter(const ofVec2f& pixels) { jitter = pixels; }
+        const ofVec2f& getJitter() const { return jitter; }
+
+        // GLSL declaring u_cameraProjection, u_cameraInverseProjection, u_cameraModelView,
+        // u_cameraInverseModelView, u_cameraModelViewProjection, u_cameraInverseModelViewProjection,
+        // u_cameraPrevModelViewProjection, u_cameraViewport (x, y, w, h), u_cameraClip (near, far) and
+        // u_cameraJitter, the ndc offset of the projection (xy) and of the previous one (zw).
+        // Needs getShaderHeader() at the top of the shader.
+        static string getShaderHeader();
+        static string getShaderSource();
+        // uploads the last update() and attaches it to shader, which is bound
+        void bind(ofShader& shader);
+
+        const ofMatrix4x4& getProjectionMatrix() const { return projection; }
+        const ofMatrix4x4& getInverseProjectionMatrix() const { return inverseProjection; }
+        const ofMatrix4x4& getModelViewMatrix() const { return modelView; }
+        const ofMatrix4x4& getInverseModelViewMatrix() const { return inverseModelView; }
+        const ofMatrix4x4& getModelViewProjectionMatrix() const { return modelViewProjection; }
+        const ofMatrix4x4& getInverseModelViewProjectionMatrix() const { return inverseModelViewProjection; }
+        const ofMatrix4x4& getPrevModelViewProjectionMatrix() const { return prevModelViewProjection; }
+        const ofRectangle& getViewport() const { return viewport; }
+        float getNearClip() const { return nearClip; }
+        float getFarClip() const { return farClip; }
+        bool isVFlipped() const { return vFlipped; }
+
+        // deletes the uniform buffer
+        void clear();
+
+    private:
+        static bool isBufferAvailable();
+        void upload();
+
+        ofMatrix4x4 projection;
+        ofMatrix4x4 inverseProjection;
+        ofMatrix4x4 modelView;
+        ofMatrix4x4 inverseModelView;
+        ofMatrix4x4 modelViewProjection;
+        ofMatrix4x4 inverseModelViewProjection;
+        ofMatrix4x4 prevModelViewProjection;
+        ofRectangle viewport;
+        float nearClip;
+        float farClip;
+        bool vFlipped;
+        uint64_t frameNum;
+        bool cutPending;
+        unsigned cutCount;
+        ofVec2f jitter;
+        ofVec2f jitterNdc;
+        ofVec2f prevJitterNdc;
+
+        GLuint buffer;
+        // changed since the last upload()
+        bool dirty;
+    };
+
+}
@@ -0,0 +1,68 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "ColorGradePass.h"
+#define STRINGIFY(A) #A
+using namespace DeferredEffect;
+
+ColorGradePass::ColorGradePass(const ofVec2f& sz) : RenderPass(sz, "ColorGradePass"),
+    exposure(1), contrast(1), saturation(1)
+{
+    if (backend != BACKEND_GL) return;
+    setupShader(shader, getPointwiseSources());
+}
+
+string ColorGradePass::getPointwiseSource() const
+{
+    return STRINGIFY
+    (
+     uniform float PASS_exposure;
+     uniform float PASS_contrast;
+     uniform float PASS_saturation;
+
+     vec4 PASS_apply(vec4 color, vec2 texCoord) {
+         vec3 c = color.rgb * PASS_exposure;
+         c = (c - vec3(0.5)) * PASS_contrast + vec3(0.5);
+         float lum = dot(c, vec3(0.299, 0.587, 0.114));
+         return vec4(mix(vec3(lum), c, PASS_saturation), color.a);
+     }
+     );
+}
+
+int ColorGradePass::setPointwiseUniforms(ofShader& shader, const string& prefix, int textureUnit)
+{
+    shader.setUniform1f(prefix + "exposure", exposure);
+    shader.setUniform1f(prefix + "contrast", contrast);
+    shader.setUniform1f(prefix + "saturation", saturation);
+    return 0;
+}
+
+void ColorGradePass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    renderPointwise(shader, readFbo, writeFbo, gbuffer);
+}
+
+bool ColorGradePass::renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool)
+{
+    int w = readPixels.getWidth();
+    int h = readPixels.getHeight();
+    pool.parallelForTiles(w, h, 32, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const float* in = readPixels.getData() + (y * w + x0) * 4;
+            float* out = writePixels.getData() + (y * w + x0) * 4;
+            for (int x = x0; x < x1; ++x, in += 4, out += 4) {
+                float c[3];
+                for (int ch = 0; ch < 3; ++ch) {
+                    c[ch] = (in[ch] * exposure - 0.5f) * contrast + 0.5f;
+                }
+                float lum = c[0] * 0.299f + c[1] * 0.587f + c[2] * 0.114f;
+                for (int ch = 0; ch < 3; ++ch) {
+                    out[ch] = ofLerp(lum, c[ch], saturation);
+                }
+                out[3] = in[3];
+            }
+        }
+    });
+    return true;
+}
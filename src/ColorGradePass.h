@@ -0,0 +1,47 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#pragma once
+#include "ofMain.h"
+#include "Processor.h"
+
+namespace DeferredEffect {
+    // Exposure, contrast and saturation of every pixel on its own. Point-wise,
+    // so Processor draws it in one shader with the point-wise passes next to it.
+    class ColorGradePass : public RenderPass {
+    public:
+        typedef shared_ptr<ColorGradePass> Ptr;
+
+        ColorGradePass(const ofVec2f& sz);
+
+        void update(ofCamera& cam) {}
+        void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool);
+
+        bool isPointwise() const { return true; }
+        string getPointwiseSource() const;
+        int setPointwiseUniforms(ofShader& shader, const string& prefix, int textureUnit);
+
+        // scale of the color, 1 by default
+        float& getExposureRef() { return exposure; }
+        float getExposure() const { return exposure; }
+        void setExposure(float exposure) { this->exposure = exposure; }
+
+        // around mid grey, 1 by default
+        float& getContrastRef() { return contrast; }
+        float getContrast() const { return contrast; }
+        void setContrast(float contrast) { this->contrast = contrast; }
+
+        // 0 is grey scale, 1 by default
+        float& getSaturationRef() { return saturation; }
+        float getSaturation() const { return saturation; }
+        void setSaturation(float saturation) { this->saturation = saturation; }
+
+    private:
+        ofShader shader;
+        float exposure;
+        float contrast;
+        float saturation;
+    };
+}
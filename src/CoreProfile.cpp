@@ -0,0 +1,157 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "CoreProfile.h"
+
+using namespace DeferredEffect;
+
+#define STRINGIFY(A) #A
+
+GLuint CoreProfile::vao = 0;
+GLuint CoreProfile::vbo = 0;
+
+// attribute locations of ofShader
+static const int POSITION_LOCATION = 0;
+static const int NORMAL_LOCATION = 2;
+static const int TEXCOORD_LOCATION = 3;
+
+static string getVertexPrelude() {
+    stringstream ss;
+    ss << "#version 330" << endl;
+    ss << "layout(location = " << POSITION_LOCATION << ") in vec4 ofPosition;" << endl;
+    ss << "layout(location = " << NORMAL_LOCATION << ") in vec3 ofNormal;" << endl;
+    ss << "layout(location = " << TEXCOORD_LOCATION << ") in vec2 ofTexcoord;" << endl;
+    ss << "uniform mat4 modelViewMatrix;" << endl;
+    ss << "uniform mat4 modelViewProjectionMatrix;" << endl;
+    // vertex colors are not read, like ofSetColor() the g buffer objects use
+    ss << "uniform vec4 globalColor;" << endl;
+    // set by drawQuad() around its draw : the unit quad scaled to the rect
+    ss << "uniform bool ofQuad;" << endl;
+    ss << "uniform vec4 ofQuadRect;" << endl;
+    ss << "uniform vec2 ofQuadTexScale;" << endl;
+    ss << "out vec4 ofTexCoord[1];" << endl;
+    ss << "out vec4 ofFrontColor;" << endl;
+    ss << "#define attribute in" << endl;
+    ss << "#define varying out" << endl;
+    ss << "#define gl_Vertex (ofQuad ? vec4(ofQuadRect.xy + ofPosition.xy * ofQuadRect.zw, 0.0, 1.0) : ofPosition)" << endl;
+    ss << "#define gl_Normal ofNormal" << endl;
+    ss << "#define gl_MultiTexCoord0 (ofQuad ? vec4(ofTexcoord * ofQuadTexScale, 0.0, 1.0) : vec4(ofTexcoord, 0.0, 1.0))" << endl;
+    ss << "#define gl_Color globalColor" << endl;
+    ss << "#define gl_ModelViewMatrix modelViewMatrix" << endl;
+    ss << "#define gl_ModelViewProjectionMatrix modelViewProjectionMatrix" << endl;
+    ss << "#define gl_NormalMatrix mat3(transpose(inverse(modelViewMatrix)))" << endl;
+    ss << "#define gl_TexCoord ofTexCoord" << endl;
+    ss << "#define gl_FrontColor ofFrontColor" << endl;
+    ss << "#define gl_InstanceIDARB gl_InstanceID" << endl;
+    return ss.str();
+}
+
+static string getFragmentPrelude() {
+    stringstream ss;
+    ss << "#version 330" << endl;
+    ss << "in vec4 ofTexCoord[1];" << endl;
+    ss << "in vec4 ofFrontColor;" << endl;
+    // draw buffers of the g buffer
+    ss << "out vec4 ofFragData[4];" << endl;
+    ss << "#define varying in" << endl;
+    ss << "#define gl_TexCoord ofTexCoord" << endl;
+    ss << "#define gl_Color ofFrontColor" << endl;
+    ss << "#define gl_FragColor ofFragData[0]" << endl;
+    ss << "#define gl_FragData ofFragData" << endl;
+    return ss.str();
+}
+
+// GL_EXT_gpu_shader4 and GL_ARB_texture_rectangle functions are core
+static string getTexturePrelude() {
+    stringstream ss;
+    ss << "#define texture2D texture" << endl;
+    ss << "#define texture2DRect texture" << endl;
+    ss << "#define textureSize2DRect textureSize" << endl;
+    ss << "#define texelFetch2DRect texelFetch" << endl;
+    ss << "#define texelFetch2D texelFetch" << endl;
+    return ss.str();
+}
+
+// the prelude brings its own #version, the extensions the shaders enable are core
+static string stripVersion(const string& source) {
+    stringstream in(source);
+    stringstream out;
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, 8, "#version") == 0) continue;
+        if (line.compare(0, 10, "#extension") == 0) continue;
+        out << line << endl;
+    }
+    return out.str();
+}
+
+CoreProfile::Sources CoreProfile::adapt(const Sources& sources)
+{
+    if (!isEnabled() || sources.count(GL_COMPUTE_SHADER)) return sources;
+
+    Sources adapted;
+    for (auto& stage : sources) {
+        if (stage.first == GL_VERTEX_SHADER) {
+            adapted[stage.first] = getVertexPrelude() + getTexturePrelude() + stripVersion(stage.second);
+        } else if (stage.first == GL_FRAGMENT_SHADER) {
+            adapted[stage.first] = getFragmentPrelude() + getTexturePrelude() + stripVersion(stage.second);
+        } else {
+            adapted[stage.first] = stage.second;
+        }
+    }
+    if (!adapted.count(GL_VERTEX_SHADER)) {
+        // what the fixed function vertex stage did for the passes
+        adapted[GL_VERTEX_SHADER] = getVertexPrelude() + STRINGIFY
+        (
+         void main() {
+             gl_TexCoord[0] = gl_MultiTexCoord0;
+             gl_FrontColor = gl_Color;
+             gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+         }
+        );
+    }
+    return adapted;
+}
+
+// Two triangles covering exactly the rect, passes draw into parts of their
+// targets. The unit quad is uploaded once, the rect and the texcoord scale go
+// to the vertex prelude of the bound program as uniforms.
+void CoreProfile::drawQuad(float x, float y, float width, float height, float s, float t)
+{
+    if (!vao) {
+        // position and texcoord of the unit quad
+        const float vertices[12] = {
+            0, 0,
+            1, 0,
+            1, 1,
+            0, 0,
+            1, 1,
+            0, 1
+        };
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(POSITION_LOCATION);
+        glVertexAttribPointer(POSITION_LOCATION, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+        glEnableVertexAttribArray(TEXCOORD_LOCATION);
+        glVertexAttribPointer(TEXCOORD_LOCATION, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        glBindVertexArray(vao);
+    }
+    
+    GLint program = 0;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    GLint quad = glGetUniformLocation(program, "ofQuad");
+    glUniform1i(quad, GL_TRUE);
+    glUniform4f(glGetUniformLocation(program, "ofQuadRect"), x, y, width, height);
+    glUniform2f(glGetUniformLocation(program, "ofQuadTexScale"), s, t);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    // the program may draw meshes too
+    glUniform1i(quad, GL_FALSE);
+    
+    glBindVertexArray(0);
+}
@@ -0,0 +1,36 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // GL 3.3 core profile support, used with the programmable renderer
+    // (ofGLWindowSettings::setGLVersion(3, 3) or later).
+    // The shaders are written once in GLSL 1.20; adapt() turns them into GLSL 3.30
+    // with a prelude that declares the attributes, varyings and outputs and maps
+    // the fixed function built-ins onto them and onto the matrix uniforms the
+    // renderer sets, e.g. gl_ModelViewProjectionMatrix -> modelViewProjectionMatrix.
+    class CoreProfile {
+    public:
+        // shader stage -> source, same as ShaderCache::Sources
+        typedef map<GLenum, string> Sources;
+
+        static bool isEnabled() { return ofIsGLProgrammableRenderer(); }
+
+        // sources unchanged without the core profile. Fragment only programs
+        // get a vertex shader passing the position, texcoord and color through.
+        // Compute shaders are left alone.
+        static Sources adapt(const Sources& sources);
+
+        // the rect as two triangles, drawn from one static vertex array shared by
+        // all passes. The bound program has to be one from adapt().
+        static void drawQuad(float x, float y, float width, float height, float s, float t);
+
+    private:
+        static GLuint vao;
+        static GLuint vbo;
+    };
+
+}
@@ -0,0 +1,45 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "CpuGBuffer.h"
+
+using namespace DeferredEffect;
+
+void CpuGBuffer::setup(int w, int h)
+{
+    for (int i = 0; i < 4; ++i) {
+        pixels[i].allocate(w, h, 4);
+    }
+    clear();
+}
+
+// same as the clear of GBuffer::begin()
+void CpuGBuffer::clear()
+{
+    for (int i = 0; i < 4; ++i) {
+        pixels[i].set(128.f / 255.f);
+        float* data = pixels[i].getData();
+        for (size_t p = 3; p < pixels[i].size(); p += 4) {
+            data[p] = 1.f;
+        }
+    }
+    // the encoded zero velocity
+    float* velocity = pixels[GBuffer::TYPE_VELOCITY].getData();
+    for (size_t p = 0; p < pixels[GBuffer::TYPE_VELOCITY].size(); p += 4) {
+        velocity[p] = velocity[p + 1] = 127.f / 255.f;
+        velocity[p + 2] = 0.f;
+    }
+}
+
+// velocity encoding :
+// http://www.crytek.com/download/Sousa_Graphics_Gems_CryENGINE3.pdf
+ofVec2f CpuGBuffer::encodeVelocity(const ofVec2f& v)
+{
+    ofVec2f encoded;
+    for (int i = 0; i < 2; ++i) {
+        float sign = v[i] > 0 ? 1.f : (v[i] < 0 ? -1.f : 0.f);
+        encoded[i] = sign * sqrt(fabs(v[i])) * 127.f / 255.f + 127.f / 255.f;
+    }
+    return encoded;
+}
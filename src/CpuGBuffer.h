@@ -0,0 +1,60 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+#include "GBuffer.h"
+
+namespace DeferredEffect {
+
+    // The GBuffer layout in host memory for Processor::BACKEND_CPU.
+    // Every buffer is 4 channel float, indexed by GBuffer::BufferType, with the
+    // same contents the GBuffer shader writes :
+    //   TYPE_ALBEDO       : rgb, 1
+    //   TYPE_NORMAL_DEPTH : view space normal, linear depth / far clip
+    //   TYPE_VELOCITY     : encodeVelocity() of the half screen space motion, 0, 1
+    // Rows are in texture coordinate order, like the pixels read back from an ofFbo.
+    class CpuGBuffer {
+    public:
+        void setup(int w, int h);
+        void clear();
+
+        ofFloatPixels& getPixels(int index) { return pixels[index]; }
+        const ofFloatPixels& getPixels(int index) const { return pixels[index]; }
+        int getWidth() const { return pixels[0].getWidth(); }
+        int getHeight() const { return pixels[0].getHeight(); }
+
+        // ndc motion * 0.5, y down
+        static ofVec2f encodeVelocity(const ofVec2f& velocity);
+
+    private:
+        ofFloatPixels pixels[4];
+    };
+
+    // texelFetch2DRect, clamped to the edge
+    inline const float* fetchPixel(const ofFloatPixels& pix, int x, int y) {
+        x = ofClamp(x, 0, pix.getWidth() - 1);
+        y = ofClamp(y, 0, pix.getHeight() - 1);
+        return pix.getData() + (y * pix.getWidth() + x) * 4;
+    }
+
+    // texture2DRect with GL_LINEAR, texel centers at .5
+    inline void samplePixel(const ofFloatPixels& pix, float x, float y, float* out) {
+        float fx = x - 0.5f;
+        float fy = y - 0.5f;
+        int x0 = floor(fx);
+        int y0 = floor(fy);
+        float tx = fx - x0;
+        float ty = fy - y0;
+        const float* p00 = fetchPixel(pix, x0, y0);
+        const float* p10 = fetchPixel(pix, x0 + 1, y0);
+        const float* p01 = fetchPixel(pix, x0, y0 + 1);
+        const float* p11 = fetchPixel(pix, x0 + 1, y0 + 1);
+        for (int c = 0; c < 4; ++c) {
+            float top = p00[c] + (p10[c] - p00[c]) * tx;
+            float bottom = p01[c] + (p11[c] - p01[c]) * tx;
+            out[c] = top + (bottom - top) * ty;
+        }
+    }
+
+}
@@ -1,12 +1,55 @@
 #include "DeferredLightingPass.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHTING_CPU_SSE
+#endif
+
 #define STRINGIFY(A) #A
 using namespace DeferredEffect;
 
-DeferredLightingPass::DeferredLightingPass(const ofVec2f& sz) : RenderPass(sz, "DeferredLightingPass")
+static const int TILE_INDEX_WIDTH = 1024;
+
+static inline ShaderCache::Sources sourcesWithHeader(const string& vert, const string& frag) {
+    string header = GBuffer::getShaderHeader();
+    ShaderCache::Sources sources;
+    if (!vert.empty()) sources[GL_VERTEX_SHADER] = header + vert;
+    sources[GL_FRAGMENT_SHADER] = header + frag;
+    return sources;
+}
+
+static inline void uploadFloatTexture(ofTexture& tex, const vector<float>& data, int w, int h, int internalFormat, int format) {
+    if (!tex.isAllocated() || tex.getWidth() < w || tex.getHeight() < h) {
+        tex.allocate(w, h, internalFormat, true);
+        tex.setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    }
+    tex.loadData(&data[0], w, h, format);
+}
+
+// projects the two tangent points of a sphere on one view space axis (a, z) to ndc
+static inline void projectSphereAxis(float a, float z, float r, bool isX, const ofMatrix4x4& proj, float& ndcMin, float& ndcMax) {
+    float len2 = a * a + z * z;
+    float len = sqrt(len2);
+    float cs = sqrt(len2 - r * r) / len;
+    float sn = r / len;
+    float ndc[2];
+    for (int i = 0; i < 2; ++i) {
+        float s = i == 0 ? sn : -sn;
+        float ta = (cs * a + s * z) * cs;
+        float tz = (-s * a + cs * z) * cs;
+        ofVec3f p = isX ? ofVec3f(ta, 0, tz) * proj : ofVec3f(0, ta, tz) * proj;
+        ndc[i] = isX ? p.x : p.y;
+    }
+    ndcMin = min(ndc[0], ndc[1]);
+    ndcMax = max(ndc[0], ndc[1]);
+}
+
+DeferredLightingPass::DeferredLightingPass(const ofVec2f& sz) : RenderPass(sz, "DeferredLightingPass"), mode(MODE_PER_LIGHT), tileSize(16)
 {
-    // ToDo
-    
+    nearClip = 1.0f;
+    farClip = 1000.0f;
+    if (backend != BACKEND_GL) return;
+
     // Shader code is modified from James Acres's of-DeferredRendering
     // https://github.com/jacres/of-DeferredRendering
     string pontLightVertShader = STRINGIFY
@@ -18,153 +61,293 @@ DeferredLightingPass::DeferredLightingPass(const ofVec2f& sz) : RenderPass(sz, "
         gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
     }
     );
-    
-    string pontLightFragShader = STRINGIFY
+
+    // shared by all lighting modes, g buffer access comes from GBuffer::getShaderSource()
+    string lightingCommonSrc = GBuffer::getShaderSource() + STRINGIFY
     (
      // deferred g buffers
      uniform sampler2DRect u_albedoTex;  // albedo (diffuse without lighting)
-     uniform sampler2DRect u_normalAndDepthTex;  // view space normal and linear depth
-     
-     // LIGHTS
-     uniform int u_numLights;
-     uniform vec3 u_lightPosition;
-     uniform vec4 u_lightAmbient;
-     uniform vec4 u_lightDiffuse;
-     uniform vec4 u_lightSpecular;
+
      uniform vec3 u_lightAttenuation;
-     uniform float u_lightIntensity;
-     uniform float u_lightRadius;
-     
-     uniform float u_farDistance;
-     uniform mat4 u_inverseProjection;
-     uniform vec4 u_viewport;
-     
+
      varying vec2 v_texCoord;
-     
+
      struct material {
          vec4 ambient;
          vec4 diffuse;
          vec4 specular;
          float shininess;
      };
-     
+
      const material material1 = material(
                                          vec4(0.1, 0.1, 0.1, 1.0),
                                          vec4(1.0, 1.0, 1.0, 1.0),
                                          vec4(1.0, 1.0, 1.0, 1.0),
                                          127.0
                                          );
-     
+
      const vec4 ambientGlobal = vec4(0.05, 0.05, 0.05, 1.0);
-     
-     void main(void)
+
+     vec3 viewSpacePosition(vec2 texCoord, float linearDepth)
     {
-        vec2 texCoord = v_texCoord;
-        
-        vec3 albedo = texture2DRect(u_albedoTex, texCoord.st).rgb;
-        
         //convert from screen to camera
         vec4 screenpos = vec4(1.0);
-        screenpos.x = 2.0 * (texCoord.x - u_viewport.x) / u_viewport.z - 1.0;
-        screenpos.y = 1.0 - 2.0 *(texCoord.y - u_viewport.y) / u_viewport.w;
-        
+        screenpos.x = 2.0 * (texCoord.x - u_cameraViewport.x) / u_cameraViewport.z - 1.0;
+        screenpos.y = 1.0 - 2.0 *(texCoord.y - u_cameraViewport.y) / u_cameraViewport.w;
+
         //get inverse
-        vec4 v_vertex = u_inverseProjection * screenpos;
-        
-        float linearDepth = texture2DRect(u_normalAndDepthTex, texCoord.st).a;
-        
+        vec4 v_vertex = u_cameraInverseProjection * screenpos;
+
         // vector to far plane
-        vec3 viewRay = vec3(v_vertex.xy * (-u_farDistance/v_vertex.z), -u_farDistance);
+        float farDistance = u_cameraClip.y;
+        vec3 viewRay = vec3(v_vertex.xy * (-farDistance/v_vertex.z), -farDistance);
         //viewRay.y = -viewRay.y;
         // scale viewRay by linear depth to get view space position
-        vec3 vertex = viewRay * linearDepth;
-        
-        vec3 normal = texture2DRect(u_normalAndDepthTex, texCoord.st).xyz;
-        
-        vec4 ambient = vec4(0.0, 0.0, 0.0, 1.0);
-        vec4 diffuse = vec4(0.0, 0.0, 0.0, 1.0);
-        vec4 specular = vec4(0.0, 0.0, 0.0, 1.0);
-        
-        vec3 lightDir = u_lightPosition - vertex;
+        return viewRay * linearDepth;
+    }
+
+     // diffuse + specular of one point light, colors are premultiplied by intensity
+     vec3 pointLight(vec3 vertex, vec3 normal, vec3 lightPosition, vec3 lightDiffuse, vec3 lightSpecular, float lightRadius)
+    {
+        vec3 lightDir = lightPosition - vertex;
         vec3 R = normalize(reflect(lightDir, normal));
         vec3 V = normalize(vertex);
-        
+
         float lambert = max(dot(normal, normalize(lightDir)), 0.0);
-        
+        vec3 color = vec3(0.0);
+
         if (lambert > 0.0) {
             float distance = length(lightDir);
-            
-            if (distance <= u_lightRadius || u_lightRadius == 0.0) {
+
+            if (distance <= lightRadius || lightRadius == 0.0) {
                 // different attenuation methods - we have to stay within bounding radius, so it's a bit trickier than forward rendering
                 //      float attenuation = 1.0 - distance/u_lightRadius;
                 //      float attenuation = 1.0 / (u_lightAttenuation.x + u_lightAttenuation.y * distance + u_lightAttenuation.z * distance * distance);
                 //      //attenuation = max(1.0, attenuation);
-                
+
                 //      (1-(x/r)^2)^3
                 //      float attenuation = (1.0 - pow(pow(distance/u_lightRadius, 2), 3));
-                
-                float distancePercent = u_lightRadius == 0.0 ? 0.0 : distance/u_lightRadius;
+
+                float distancePercent = lightRadius == 0.0 ? 0.0 : distance/lightRadius;
                 float damping_factor = 1.0 - pow(distancePercent, 3.0);
                 float attenuation = 1.0/(u_lightAttenuation.x +
                                          u_lightAttenuation.y * distance +
                                          u_lightAttenuation.z * distance * distance);
                 attenuation *= damping_factor;
-                
-                vec4 diffuseContribution = material1.diffuse * u_lightDiffuse * lambert;
-                diffuseContribution *= u_lightIntensity;
-                diffuseContribution *= attenuation;
-                
-                vec4 specularContribution = material1.specular * u_lightSpecular * pow(max(dot(R, V), 0.0), material1.shininess);
-                specularContribution *= u_lightIntensity;
-                specularContribution *= attenuation;
-                
-                diffuse += diffuseContribution;
-                specular += specularContribution;
+
+                color += material1.diffuse.rgb * lightDiffuse * lambert * attenuation;
+                color += material1.specular.rgb * lightSpecular * pow(max(dot(R, V), 0.0), material1.shininess) * attenuation;
             }
         }
-        
-        vec4 final_color = vec4(ambient + diffuse + specular);
-        gl_FragColor = vec4(final_color.rgb * albedo, 1.0);
+        return color;
     }
      );
 
-    shader.setupShaderFromSource(GL_VERTEX_SHADER, pontLightVertShader);
-    shader.setupShaderFromSource(GL_FRAGMENT_SHADER, pontLightFragShader);
-    shader.linkProgram();
-}
+    string pontLightFragShader = STRINGIFY
+    (
+     // LIGHTS
+     uniform int u_numLights;
+     uniform vec3 u_lightPosition;
+     uniform vec4 u_lightAmbient;
+     uniform vec4 u_lightDiffuse;
+     uniform vec4 u_lightSpecular;
+     uniform float u_lightIntensity;
+     uniform float u_lightRadius;
+
+     void main(void)
+    {
+        vec2 texCoord = v_texCoord;
+
+        vec3 albedo = texture2DRect(u_albedoTex, texCoord.st).rgb;
+        float linearDepth = gbufferLinearDepth(texCoord.st);
+        vec3 vertex = viewSpacePosition(texCoord, linearDepth);
+        vec3 normal = gbufferNormal(texCoord.st);
+
+        vec3 color = pointLight(vertex, normal, u_lightPosition,
+                                u_lightDiffuse.rgb * u_lightIntensity,
+                                u_lightSpecular.rgb * u_lightIntensity,
+                                u_lightRadius);
+        gl_FragColor = vec4(color * albedo, 1.0);
+    }
+     );
+
+    // all lights accumulated in one draw
+    string singlePassFragShader = STRINGIFY
+    (
+     uniform sampler2DRect u_lightDataTex;  // x : light, y : position + radius, diffuse, specular
+     uniform int u_numLights;
+
+     void main(void)
+    {
+        vec2 texCoord = v_texCoord;
 
+        vec3 albedo = texture2DRect(u_albedoTex, texCoord.st).rgb;
+        vec3 vertex = viewSpacePosition(texCoord, gbufferLinearDepth(texCoord.st));
+        vec3 normal = gbufferNormal(texCoord.st);
+
+        vec3 color = vec3(0.0);
+        for (int i=0; i<u_numLights; ++i) {
+            vec4 positionAndRadius = texelFetch2DRect(u_lightDataTex, ivec2(i, 0));
+            color += pointLight(vertex, normal, positionAndRadius.xyz,
+                                texelFetch2DRect(u_lightDataTex, ivec2(i, 1)).rgb,
+                                texelFetch2DRect(u_lightDataTex, ivec2(i, 2)).rgb,
+                                positionAndRadius.w);
+        }
+        gl_FragColor = vec4(color * albedo, 1.0);
+    }
+     );
+
+    // min / max linear depth of every tile, drawn into a tile sized target
+    string tileDepthFragShader = STRINGIFY
+    (
+     uniform float u_tileSize;
+     uniform vec2 u_size;
+     void main() {
+         int tileSize = int(u_tileSize);
+         int startx = int(gl_TexCoord[0].x) * tileSize;
+         int starty = int(gl_TexCoord[0].y) * tileSize;
+         int endx = min(startx + tileSize, int(u_size.x));
+         int endy = min(starty + tileSize, int(u_size.y));
+         float minDepth = 1.0;
+         float maxDepth = 0.0;
+         for (int y=starty; y<endy; ++y) {
+             for (int x=startx; x<endx; ++x) {
+                 float d = gbufferLinearDepth(vec2(x,y) + vec2(0.5));
+                 minDepth = min(minDepth, d);
+                 maxDepth = max(maxDepth, d);
+             }
+         }
+         gl_FragColor = vec4(minDepth, maxDepth, 0.0, 1.0);
+     }
+     );
+
+    string tiledFragShader = STRINGIFY
+    (
+     uniform sampler2DRect u_lightDataTex;  // x : light, y : position + radius, diffuse, specular
+     uniform sampler2DRect u_tileHeaderTex; // offset and count into u_tileIndexTex
+     uniform sampler2DRect u_tileIndexTex;  // light indices, u_tileIndexWidth per row
+     uniform sampler2DRect u_tileDepthTex;  // min / max linear depth
+     uniform float u_tileSize;
+     uniform int u_tileIndexWidth;
+
+     void main(void)
+    {
+        vec2 texCoord = v_texCoord;
+
+        vec3 albedo = texture2DRect(u_albedoTex, texCoord.st).rgb;
+        vec3 vertex = viewSpacePosition(texCoord, gbufferLinearDepth(texCoord.st));
+        vec3 normal = gbufferNormal(texCoord.st);
+
+        ivec2 tile = ivec2(texCoord / u_tileSize);
+        vec2 header = texelFetch2DRect(u_tileHeaderTex, tile).xy;
+        vec2 depthRange = texelFetch2DRect(u_tileDepthTex, tile).xy * u_cameraClip.y;
+        int offset = int(header.x);
+        int count = int(header.y);
+
+        vec3 color = vec3(0.0);
+        for (int i=0; i<count; ++i) {
+            int index = offset + i;
+            int row = index / u_tileIndexWidth;
+            int light = int(texelFetch2DRect(u_tileIndexTex, ivec2(index - row * u_tileIndexWidth, row)).r);
+            vec4 positionAndRadius = texelFetch2DRect(u_lightDataTex, ivec2(light, 0));
+
+            // the light sphere has to overlap the depth range of the tile
+            float lightDepth = -positionAndRadius.z;
+            float radius = positionAndRadius.w;
+            if (radius > 0.0 && (lightDepth + radius < depthRange.x || lightDepth - radius > depthRange.y)) {
+                continue;
+            }
+            color += pointLight(vertex, normal, positionAndRadius.xyz,
+                                texelFetch2DRect(u_lightDataTex, ivec2(light, 1)).rgb,
+                                texelFetch2DRect(u_lightDataTex, ivec2(light, 2)).rgb,
+                                radius);
+        }
+        gl_FragColor = vec4(color * albedo, 1.0);
+    }
+     );
+
+    setupShader(shader, sourcesWithHeader(pontLightVertShader, lightingCommonSrc + pontLightFragShader));
+
+    setupShader(singlePassShader, sourcesWithHeader(pontLightVertShader, lightingCommonSrc + singlePassFragShader));
+    setupShader(tileDepthShader, sourcesWithHeader("", GBuffer::getShaderSource() + tileDepthFragShader));
+    setupShader(tiledShader, sourcesWithHeader(pontLightVertShader, lightingCommonSrc + tiledFragShader));
+}
 
 void DeferredLightingPass::update(ofCamera& cam)
 {
-    farClip = cam.getFarClip();
-    isVFlipped = cam.isVFlipped();
-    ofRectangle viewport(0, 0, size.x, size.y);
-    projectionMatrix = cam.getProjectionMatrix(viewport);
-    modelViewMatrix = cam.getModelViewMatrix();
+    const CameraData& camera = getCameraData(cam);
+    nearClip = camera.getNearClip();
+    farClip = camera.getFarClip();
+    isVFlipped = camera.isVFlipped();
+    projectionMatrix = camera.getProjectionMatrix();
+    inverseProjectionMatrix = camera.getInverseProjectionMatrix();
+    modelViewMatrix = camera.getModelViewMatrix();
+    cullLights();
+}
+
+void DeferredLightingPass::cullLights()
+{
+    culler.resize(lights.size());
+    for (int i = 0; i < lights.size(); ++i) {
+        culler.set(i, lights[i].position, lights[i].radius);
+    }
+    culler.cull(modelViewMatrix, projectionMatrix);
 }
 
 void DeferredLightingPass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    // lights added after update()
+    if (culler.size() != lights.size()) {
+        cullLights();
+    }
+
+    if (mode == MODE_SINGLE_PASS) {
+        renderSinglePass(writeFbo, gbuffer);
+    } else if (mode == MODE_TILED) {
+        renderTiled(writeFbo, gbuffer);
+    } else {
+        renderPerLight(writeFbo, gbuffer, mode == MODE_LIGHT_VOLUME);
+    }
+}
+
+void DeferredLightingPass::renderPerLight(ofFbo& writeFbo, GBuffer& gbuffer, bool useLightVolumes)
 {
     shader.begin();
     // pass in lighting info
     int numLights = lights.size();
     shader.setUniform1i("u_numLights", numLights);
-    shader.setUniform1f("u_farDistance", farClip);
-    shader.setUniform4f("u_viewport", 0, 0, size.x, size.y);
-    shader.setUniformMatrix4f("u_inverseProjection", projectionMatrix.getInverse());
     shader.setUniform3f("u_lightAttenuation", 1, 0, 0);
     shader.setUniformTexture("u_albedoTex", gbuffer.getTexture(GBuffer::TYPE_ALBEDO), 1);
-    shader.setUniformTexture("u_normalAndDepthTex", gbuffer.getTexture(GBuffer::TYPE_NORMAL_DEPTH), 2);
+    gbuffer.setShaderUniforms(shader, 7);
     shader.end();
-    
+
     writeFbo.begin();
     ofClear(0);
     ofPushStyle();
     ofEnableBlendMode(OF_BLENDMODE_ADD);
-    
+    if (useLightVolumes) {
+        glEnable(GL_SCISSOR_TEST);
+    }
+
     shader.begin();
-    for (DeferredLight& light : lights) {
-        ofVec3f lightPosInViewSpace = light.position * modelViewMatrix;
+    for (int index : culler.getVisible()) {
+        DeferredLight& light = lights[index];
+        ofVec3f lightPosInViewSpace = culler.getViewPosition(index);
+        if (useLightVolumes) {
+            // only rasterize the pixels the light sphere can reach
+            ofRectangle rect;
+            if (!getScreenRect(lightPosInViewSpace, light.radius, rect)) {
+                continue;
+            }
+            int x0 = floor(rect.x);
+            int y0 = floor(rect.y);
+            int x1 = ceil(rect.x + rect.width);
+            int y1 = ceil(rect.y + rect.height);
+            if (x1 <= x0 || y1 <= y0) {
+                continue;
+            }
+            glScissor(x0, y0, x1 - x0, y1 - y0);
+        }
         shader.setUniform3fv("u_lightPosition", &lightPosInViewSpace.getPtr()[0]);
         shader.setUniform4fv("u_lightAmbient", light.ambientColor.v);
         shader.setUniform4fv("u_lightDiffuse", light.diffuseColor.v);
@@ -174,7 +357,378 @@ void DeferredLightingPass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuf
         texturedQuad(0, 0, size.x, size.y, size.x, size.y);
     }
     shader.end();
-    
+
+    if (useLightVolumes) {
+        glDisable(GL_SCISSOR_TEST);
+    }
+    ofPopStyle();
+    writeFbo.end();
+}
+
+void DeferredLightingPass::renderSinglePass(ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    updateLightData();
+
+    writeFbo.begin();
+    ofClear(0);
+    ofPushStyle();
+    ofDisableAlphaBlending();
+
+    singlePassShader.begin();
+    singlePassShader.setUniform3f("u_lightAttenuation", 1, 0, 0);
+    singlePassShader.setUniform1i("u_numLights", culler.getVisible().size());
+    singlePassShader.setUniformTexture("u_albedoTex", gbuffer.getTexture(GBuffer::TYPE_ALBEDO), 1);
+    gbuffer.setShaderUniforms(singlePassShader, 7);
+    singlePassShader.setUniformTexture("u_lightDataTex", lightDataTex, 3);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    singlePassShader.end();
+
     ofPopStyle();
     writeFbo.end();
-}
\ No newline at end of file
+}
+
+void DeferredLightingPass::renderTiled(ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    int tilesX = ceil(size.x / tileSize);
+    int tilesY = ceil(size.y / tileSize);
+
+    updateLightData();
+    binLights();
+
+    uploadFloatTexture(tileHeaderTex, tileHeaders, tilesX, tilesY, GL_RG32F, GL_RG);
+    uploadFloatTexture(tileIndexTex, tileIndices, TILE_INDEX_WIDTH, tileIndices.size() / TILE_INDEX_WIDTH, GL_R32F, GL_RED);
+
+    // min/max linear depth per tile, the target is kept at full size as size follows the resolution scale
+    ofFbo& fboTileDepth = acquireTarget(ceil(fullSize.x / tileSize), ceil(fullSize.y / tileSize), GL_RG32F);
+    fboTileDepth.getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    fboTileDepth.begin();
+    ofClear(0);
+    tileDepthShader.begin();
+    gbuffer.setShaderUniforms(tileDepthShader, 1);
+    tileDepthShader.setUniform1f("u_tileSize", tileSize);
+    tileDepthShader.setUniform2f("u_size", size.x, size.y);
+    texturedQuad(0, 0, tilesX, tilesY, tilesX, tilesY);
+    tileDepthShader.end();
+    fboTileDepth.end();
+
+    writeFbo.begin();
+    ofClear(0);
+    ofPushStyle();
+    ofDisableAlphaBlending();
+
+    tiledShader.begin();
+    tiledShader.setUniform3f("u_lightAttenuation", 1, 0, 0);
+    tiledShader.setUniform1f("u_tileSize", tileSize);
+    tiledShader.setUniform1i("u_tileIndexWidth", TILE_INDEX_WIDTH);
+    tiledShader.setUniformTexture("u_albedoTex", gbuffer.getTexture(GBuffer::TYPE_ALBEDO), 1);
+    gbuffer.setShaderUniforms(tiledShader, 7);
+    tiledShader.setUniformTexture("u_lightDataTex", lightDataTex, 3);
+    tiledShader.setUniformTexture("u_tileHeaderTex", tileHeaderTex, 4);
+    tiledShader.setUniformTexture("u_tileIndexTex", tileIndexTex, 5);
+    tiledShader.setUniformTexture("u_tileDepthTex", fboTileDepth.getTextureReference(), 6);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    tiledShader.end();
+
+    ofPopStyle();
+    writeFbo.end();
+    
+    releaseTarget(fboTileDepth);
+}
+
+void DeferredLightingPass::updateLightData()
+{
+    packLightData();
+    int width = max<int>(culler.getVisible().size(), 1);
+    uploadFloatTexture(lightDataTex, lightData, width, 3, GL_RGBA32F_ARB, GL_RGBA);
+}
+
+// lightData rows : view space position + radius, diffuse * intensity, specular * intensity.
+// Only lights that passed the frustum cull are packed.
+void DeferredLightingPass::packLightData()
+{
+    const vector<int>& visibleLights = culler.getVisible();
+    int numLights = visibleLights.size();
+    int width = max(numLights, 1);
+    lightData.assign(width * 3 * 4, 0.f);
+    float* position = &lightData[0];
+    float* diffuse = position + width * 4;
+    float* specular = diffuse + width * 4;
+    for (int i = 0; i < numLights; ++i) {
+        const DeferredLight& light = lights[visibleLights[i]];
+        ofVec3f p = culler.getViewPosition(visibleLights[i]);
+        position[i * 4 + 0] = p.x;
+        position[i * 4 + 1] = p.y;
+        position[i * 4 + 2] = p.z;
+        position[i * 4 + 3] = light.radius;
+        for (int c = 0; c < 4; ++c) {
+            diffuse[i * 4 + c] = light.diffuseColor.v[c] * light.intensity;
+            specular[i * 4 + c] = light.specularColor.v[c] * light.intensity;
+        }
+    }
+}
+
+// counting sort of the lights into the tiles their projected spheres touch
+void DeferredLightingPass::binLights()
+{
+    int tilesX = ceil(size.x / tileSize);
+    int tilesY = ceil(size.y / tileSize);
+    int numTiles = tilesX * tilesY;
+    int numLights = culler.getVisible().size();
+
+    vector<int> counts(numTiles, 0);
+    lightTiles.assign(numLights * 4, -1);
+    const float* position = &lightData[0];
+    for (int i = 0; i < numLights; ++i) {
+        ofVec3f p(position[i * 4 + 0], position[i * 4 + 1], position[i * 4 + 2]);
+        ofRectangle rect;
+        if (!getScreenRect(p, position[i * 4 + 3], rect)) {
+            continue;
+        }
+        int x0 = ofClamp(floor(rect.x / tileSize), 0, tilesX - 1);
+        int y0 = ofClamp(floor(rect.y / tileSize), 0, tilesY - 1);
+        int x1 = ofClamp(floor((rect.x + rect.width) / tileSize), 0, tilesX - 1);
+        int y1 = ofClamp(floor((rect.y + rect.height) / tileSize), 0, tilesY - 1);
+        lightTiles[i * 4 + 0] = x0;
+        lightTiles[i * 4 + 1] = y0;
+        lightTiles[i * 4 + 2] = x1;
+        lightTiles[i * 4 + 3] = y1;
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                counts[y * tilesX + x]++;
+            }
+        }
+    }
+
+    tileHeaders.resize(numTiles * 2);
+    int total = 0;
+    for (int t = 0; t < numTiles; ++t) {
+        tileHeaders[t * 2 + 0] = total;
+        tileHeaders[t * 2 + 1] = counts[t];
+        total += counts[t];
+    }
+
+    int rows = max(1, (total + TILE_INDEX_WIDTH - 1) / TILE_INDEX_WIDTH);
+    tileIndices.assign(rows * TILE_INDEX_WIDTH, 0.f);
+    vector<int> cursor(numTiles);
+    for (int t = 0; t < numTiles; ++t) {
+        cursor[t] = tileHeaders[t * 2];
+    }
+    for (int i = 0; i < numLights; ++i) {
+        if (lightTiles[i * 4] < 0) {
+            continue;
+        }
+        for (int y = lightTiles[i * 4 + 1]; y <= lightTiles[i * 4 + 3]; ++y) {
+            for (int x = lightTiles[i * 4 + 0]; x <= lightTiles[i * 4 + 2]; ++x) {
+                tileIndices[cursor[y * tilesX + x]++] = i;
+            }
+        }
+    }
+}
+
+// Conservative screen bounds of a view space sphere in the pixel space the lighting shaders use.
+// Returns false if the sphere can't touch any pixel.
+bool DeferredLightingPass::getScreenRect(const ofVec3f& p, float radius, ofRectangle& rect) const
+{
+    rect.set(0, 0, size.x, size.y);
+    if (radius <= 0) return true; // unbounded
+    if (p.z - radius > -nearClip || -p.z - radius > farClip) return false;
+    if (p.z + radius > -nearClip) return true; // camera is inside or too close, covers everything
+
+    float minX, maxX, minY, maxY;
+    projectSphereAxis(p.x, p.z, radius, true, projectionMatrix, minX, maxX);
+    projectSphereAxis(p.y, p.z, radius, false, projectionMatrix, minY, maxY);
+    if (minX > 1 || maxX < -1 || minY > 1 || maxY < -1) return false;
+
+    float x0 = (ofClamp(minX, -1, 1) * 0.5 + 0.5) * size.x;
+    float x1 = (ofClamp(maxX, -1, 1) * 0.5 + 0.5) * size.x;
+    float y0 = (1.0 - ofClamp(maxY, -1, 1)) * 0.5 * size.y;
+    float y1 = (1.0 - ofClamp(minY, -1, 1)) * 0.5 * size.y;
+    rect.set(x0, y0, x1 - x0, y1 - y0);
+    return true;
+}
+
+//--------------------------------------------------------------
+// cpu backend
+
+// x^127, the material shininess, with squarings only
+static inline float powShininess(float x) {
+    float x2 = x * x, x4 = x2 * x2, x8 = x4 * x4, x16 = x8 * x8, x32 = x16 * x16, x64 = x32 * x32;
+    return x64 * x32 * x16 * x8 * x4 * x2 * x;
+}
+
+// the lights of one tile, structure of arrays padded to a multiple of 4
+struct TileLights {
+    enum { X, Y, Z, RADIUS, DIFFUSE_R, DIFFUSE_G, DIFFUSE_B, SPECULAR_R, SPECULAR_G, SPECULAR_B, NUM_ARRAYS };
+    vector<float> arrays[NUM_ARRAYS];
+    int count;
+    
+    void clear() {
+        count = 0;
+        for (int i = 0; i < NUM_ARRAYS; ++i) arrays[i].clear();
+    }
+    void add(const float* position, const float* diffuse, const float* specular) {
+        const float values[NUM_ARRAYS] = {
+            position[0], position[1], position[2], position[3],
+            diffuse[0], diffuse[1], diffuse[2], specular[0], specular[1], specular[2]
+        };
+        for (int i = 0; i < NUM_ARRAYS; ++i) arrays[i].push_back(values[i]);
+        ++count;
+    }
+    // padding lights are far away and black
+    void pad() {
+        const float padding[4] = { 0.f, 0.f, 1e10f, 1.f };
+        const float black[4] = { 0.f, 0.f, 0.f, 0.f };
+        while (arrays[X].size() % 4) add(padding, black, black);
+    }
+    const float* get(int i) const { return &arrays[i][0]; }
+};
+
+// pointLight() of the shaders summed over all tile lights,
+// u_lightAttenuation is (1, 0, 0) so the attenuation is the damping factor only
+static inline void shadeLights(const TileLights& tl, const ofVec3f& p, const ofVec3f& n, const ofVec3f& v, float* color) {
+    const float* lx = tl.get(TileLights::X);
+    const float* ly = tl.get(TileLights::Y);
+    const float* lz = tl.get(TileLights::Z);
+    const float* lr = tl.get(TileLights::RADIUS);
+    const float* dr = tl.get(TileLights::DIFFUSE_R);
+    const float* dg = tl.get(TileLights::DIFFUSE_G);
+    const float* db = tl.get(TileLights::DIFFUSE_B);
+    const float* sr = tl.get(TileLights::SPECULAR_R);
+    const float* sg = tl.get(TileLights::SPECULAR_G);
+    const float* sb = tl.get(TileLights::SPECULAR_B);
+    float nv = n.dot(v);
+    int size = tl.arrays[TileLights::X].size();
+#if defined(LIGHTING_CPU_SSE)
+    __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+    __m128 nx = _mm_set1_ps(n.x), ny = _mm_set1_ps(n.y), nz = _mm_set1_ps(n.z);
+    __m128 vx = _mm_set1_ps(v.x), vy = _mm_set1_ps(v.y), vz = _mm_set1_ps(v.z);
+    __m128 twoNv = _mm_set1_ps(2.f * nv);
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 sumR = zero, sumG = zero, sumB = zero;
+    for (int i = 0; i < size; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(lx + i), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(ly + i), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(lz + i), pz);
+        __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        __m128 invDist = _mm_div_ps(one, dist);
+        __m128 nl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz));
+        __m128 lambert = _mm_mul_ps(nl, invDist);
+        
+        // dot(normalize(reflect(l, n)), v), |reflect(l, n)| == |l|
+        __m128 lv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, dx), _mm_mul_ps(vy, dy)), _mm_mul_ps(vz, dz));
+        __m128 rv = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(lv, _mm_mul_ps(twoNv, nl)), invDist), zero);
+        __m128 rv2 = _mm_mul_ps(rv, rv), rv4 = _mm_mul_ps(rv2, rv2), rv8 = _mm_mul_ps(rv4, rv4);
+        __m128 rv16 = _mm_mul_ps(rv8, rv8), rv32 = _mm_mul_ps(rv16, rv16), rv64 = _mm_mul_ps(rv32, rv32);
+        __m128 spec = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(rv64, rv32), _mm_mul_ps(rv16, rv8)), _mm_mul_ps(_mm_mul_ps(rv4, rv2), rv));
+        
+        __m128 radius = _mm_loadu_ps(lr + i);
+        __m128 unbounded = _mm_cmpeq_ps(radius, zero);
+        __m128 percent = _mm_andnot_ps(unbounded, _mm_div_ps(dist, radius));
+        __m128 attenuation = _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(percent, percent), percent));
+        __m128 mask = _mm_and_ps(_mm_cmpgt_ps(lambert, zero), _mm_or_ps(_mm_cmple_ps(dist, radius), unbounded));
+        __m128 diffuse = _mm_and_ps(mask, _mm_mul_ps(lambert, attenuation));
+        spec = _mm_and_ps(mask, _mm_mul_ps(spec, attenuation));
+        
+        sumR = _mm_add_ps(sumR, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dr + i), diffuse), _mm_mul_ps(_mm_loadu_ps(sr + i), spec)));
+        sumG = _mm_add_ps(sumG, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dg + i), diffuse), _mm_mul_ps(_mm_loadu_ps(sg + i), spec)));
+        sumB = _mm_add_ps(sumB, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(db + i), diffuse), _mm_mul_ps(_mm_loadu_ps(sb + i), spec)));
+    }
+    float lanes[3][4];
+    _mm_storeu_ps(lanes[0], sumR);
+    _mm_storeu_ps(lanes[1], sumG);
+    _mm_storeu_ps(lanes[2], sumB);
+    for (int c = 0; c < 3; ++c) {
+        color[c] = lanes[c][0] + lanes[c][1] + lanes[c][2] + lanes[c][3];
+    }
+#else
+    color[0] = color[1] = color[2] = 0.f;
+    for (int i = 0; i < size; ++i) {
+        ofVec3f l(lx[i] - p.x, ly[i] - p.y, lz[i] - p.z);
+        float dist = l.length();
+        float nl = n.dot(l);
+        float lambert = nl / dist;
+        bool unbounded = lr[i] == 0.f;
+        if (lambert <= 0.f || (dist > lr[i] && !unbounded)) continue;
+        float percent = unbounded ? 0.f : dist / lr[i];
+        float attenuation = 1.f - percent * percent * percent;
+        float spec = powShininess(max((l.dot(v) - 2.f * nv * nl) / dist, 0.f)) * attenuation;
+        float diffuse = lambert * attenuation;
+        color[0] += dr[i] * diffuse + sr[i] * spec;
+        color[1] += dg[i] * diffuse + sg[i] * spec;
+        color[2] += db[i] * diffuse + sb[i] * spec;
+    }
+#endif
+}
+
+bool DeferredLightingPass::renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool)
+{
+    // lights added after update()
+    if (culler.size() != lights.size()) {
+        cullLights();
+    }
+    packLightData();
+    binLights();
+    
+    int numLights = culler.getVisible().size();
+    int width = max(numLights, 1);
+    const float* position = &lightData[0];
+    const float* diffuse = position + width * 4;
+    const float* specular = diffuse + width * 4;
+    
+    const ofFloatPixels& albedo = gbuffer.getPixels(GBuffer::TYPE_ALBEDO);
+    const ofFloatPixels& normalDepth = gbuffer.getPixels(GBuffer::TYPE_NORMAL_DEPTH);
+    int w = writePixels.getWidth();
+    int h = writePixels.getHeight();
+    int tilesX = ceil(size.x / tileSize);
+    
+    pool.parallelForTiles(w, h, tileSize, [&](int x0, int y0, int x1, int y1) {
+        float minDepth = 1.0;
+        float maxDepth = 0.0;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                float d = fetchPixel(normalDepth, x, y)[3];
+                minDepth = min(minDepth, d);
+                maxDepth = max(maxDepth, d);
+            }
+        }
+        
+        int tile = (y0 / tileSize) * tilesX + x0 / tileSize;
+        int offset = tileHeaders[tile * 2];
+        int count = tileHeaders[tile * 2 + 1];
+        TileLights tl;
+        tl.clear();
+        for (int i = 0; i < count; ++i) {
+            int light = tileIndices[offset + i];
+            const float* p = position + light * 4;
+            float radius = p[3];
+            if (radius > 0 && ((-p[2] + radius) / farClip < minDepth || (-p[2] - radius) / farClip > maxDepth)) {
+                continue;
+            }
+            tl.add(p, diffuse + light * 4, specular + light * 4);
+        }
+        tl.pad();
+        
+        for (int y = y0; y < y1; ++y) {
+            float* out = writePixels.getData() + (y * w + x0) * 4;
+            for (int x = x0; x < x1; ++x, out += 4) {
+                const float* nd = fetchPixel(normalDepth, x, y);
+                const float* a = fetchPixel(albedo, x, y);
+                float color[3] = { 0.f, 0.f, 0.f };
+                if (tl.count > 0) {
+                    // viewSpacePosition() : ray through the pixel, scaled to the far plane
+                    float sx = 2.0 * (x + 0.5) / size.x - 1.0;
+                    float sy = 1.0 - 2.0 * (y + 0.5) / size.y;
+                    ofVec4f ray = ofVec4f(sx, sy, 1.0, 1.0) * inverseProjectionMatrix;
+                    ofVec3f vertex = ofVec3f(ray.x * (-farClip / ray.z), ray.y * (-farClip / ray.z), -farClip) * nd[3];
+                    ofVec3f normal(nd[0], nd[1], nd[2]);
+                    shadeLights(tl, vertex, normal, vertex.getNormalized(), color);
+                }
+                out[0] = color[0] * a[0];
+                out[1] = color[1] * a[1];
+                out[2] = color[2] * a[2];
+                out[3] = 1.0;
+            }
+        }
+    });
+    return true;
+}
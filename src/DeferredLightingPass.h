@@ -1,6 +1,7 @@
 #pragma once
 #include "ofMain.h"
 #include "Processor.h"
+#include "LightCuller.h"
 
 // Part of this code is from James Acres's of-DeferredRendering
 // https://github.com/jacres/of-DeferredRendering
@@ -25,18 +26,63 @@ namespace DeferredEffect {
     
     
     class DeferredLightingPass : public RenderPass {
+    public:
+        enum Mode {
+            MODE_SINGLE_PASS,  // all lights uploaded to a float texture and accumulated in one draw
+            MODE_PER_LIGHT,    // one additive full-screen quad per light
+            MODE_LIGHT_VOLUME, // one additive quad per light, scissored to its projected sphere
+            MODE_TILED         // lights binned into screen tiles, every pixel shaded once
+        };
+
     protected:
         vector<DeferredLight> lights;
         ofShader shader;
+        float nearClip;
         float farClip;
         ofMatrix4x4 projectionMatrix;
+        ofMatrix4x4 inverseProjectionMatrix;
         ofMatrix4x4 modelViewMatrix;
         bool isVFlipped;
+        Mode mode;
+        LightCuller culler;
+
+        // single pass and tiled modes
+        ofShader singlePassShader;
+        ofTexture lightDataTex; // view space position + radius, diffuse, specular per visible light
+        vector<float> lightData;
+
+        // tiled mode
+        int tileSize;
+        ofShader tileDepthShader;
+        ofShader tiledShader;
+        ofTexture tileHeaderTex; // offset and count into tileIndexTex per tile
+        ofTexture tileIndexTex; // light indices of all tiles, packed
+        vector<float> tileHeaders;
+        vector<float> tileIndices;
+        vector<int> lightTiles;
+
+        void cullLights();
+        void updateLightData();
+        void packLightData();
+        void binLights();
+        bool getScreenRect(const ofVec3f& viewPos, float radius, ofRectangle& rect) const;
+
+        void renderSinglePass(ofFbo& writeFbo, GBuffer& gbuffer);
+        void renderPerLight(ofFbo& writeFbo, GBuffer& gbuffer, bool useLightVolumes);
+        void renderTiled(ofFbo& writeFbo, GBuffer& gbuffer);
     public:
         typedef shared_ptr<DeferredLightingPass> Ptr;
-        
+
         DeferredLightingPass(const ofVec2f& sz);
-        
+
+        // MODE_PER_LIGHT by default
+        void setMode(Mode mode) { this->mode = mode; }
+        Mode getMode() const { return mode; }
+
+        // tile edge in pixels for MODE_TILED
+        void setTileSize(int tileSize) { this->tileSize = max(tileSize, 1); }
+        int getTileSize() const { return tileSize; }
+
         // Currently only point light is supported.
         void addLight(DeferredLight light) {
             lights.push_back(light);
@@ -51,5 +97,7 @@ namespace DeferredEffect {
         
         void update(ofCamera& cam);
         void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        // always tiled, lights are shaded four at a time with SSE when available
+        bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool);
     };
 }
@@ -36,8 +36,12 @@
 using namespace DeferredEffect;
 
 DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float fStop, bool showFocus) :
-    focalDepth(focalDepth), focalLength(focalLength), fStop(fStop), showFocus(showFocus), RenderPass(sz, "dofalt")
+    RenderPass(sz, "dofalt"), focalDepth(focalDepth), focalLength(focalLength), fStop(fStop), showFocus(showFocus), resolution(RESOLUTION_FULL),
+    samples(3), rings(5), pentagon(false), vignetting(false), manualDof(false), autofocus(false), noise(true), depthBlur(false), temporalJitter(false),
+    kernelSamples(0), kernelRings(0)
 {
+    if (backend != BACKEND_GL) return;
+    
     string fragShaderSrc = STRINGIFY(
         /*
          DoF with bokeh GLSL shader v2.4
@@ -83,7 +87,6 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
          */
 
         uniform sampler2DRect bgl_RenderedTexture;
-        uniform sampler2DRect bgl_NormalDepthTexture;
         uniform float bgl_RenderedTextureWidth;
         uniform float bgl_RenderedTextureHeight;
                                                  
@@ -99,22 +102,20 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
         uniform float focalDepth;  //focal distance value in meters, but you may use autofocus option below
         uniform float focalLength; //focal length in mm
         uniform float fstop; //f-stop value
-        uniform bool showFocus; //show debug focus point and focal range (red = focal point, green = focal range)
-
-        /* 
-        make sure that these two values are the same for your camera, otherwise distances will be wrong.
-        */
-
-        uniform float znear; //camera clipping start
-        uniform float zfar; //camera clipping end
+        uniform vec2 kernelRotation; //cos, sin of the bokeh kernel rotation of this frame
+        uniform vec2 noiseOffset; //moves the dither pattern every frame
+        const bool showFocus = DOF_SHOW_FOCUS; //show debug focus point and focal range (red = focal point, green = focal range)
+        const bool writeBlur = DOF_WRITE_BLUR; //low resolution gather, keep the blur factor in alpha for the composite
 
         //------------------------------------------
         //user variables
 
-        int samples = 3; //samples on the first ring
-        int rings = 5; //ring count
+        const int samples = DOF_SAMPLES; //samples on the first ring
+        const int rings = DOF_RINGS; //ring count
+        const int maxTaps = samples * rings * (rings + 1) / 2;
+        uniform sampler2DRect bokehKernelTex; //row r-1 : the taps of r rings (unit offset, weight, pentagon shape)
 
-        bool manualdof = false; //manual dof calculation
+        const bool manualdof = DOF_MANUAL; //manual dof calculation
         float ndofstart = 1.0; //near dof blur start
         float ndofdist = 2.0; //near dof blur falloff distance
         float fdofstart = 1.0; //far dof blur start
@@ -122,25 +123,24 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
 
         float CoC = 0.03;//circle of confusion size in mm (35mm film = 0.03mm)
 
-        bool vignetting = false; //use optical lens vignetting?
+        const bool vignetting = DOF_VIGNETTING; //use optical lens vignetting?
         float vignout = 1.3; //vignetting outer border
         float vignin = 0.0; //vignetting inner border
         float vignfade = 22.0; //f-stops till vignete fades
 
-        bool autofocus = false; //use autofocus in shader? disable if you use external focalDepth value
+        const bool autofocus = DOF_AUTOFOCUS; //use autofocus in shader? disable if you use external focalDepth value
         vec2 focus = vec2(width*0.5,height*0.5); // autofocus point on screen (0.0,0.0 - left lower corner, 1.0,1.0 - upper right)
         float maxblur = 1.5; //clamp value of max blur (0.0 = no blur,1.0 default)
 
         float threshold = 0.5; //highlight threshold;
         float gain = 2.0; //highlight gain;
 
-        float bias = 0.5; //bokeh edge bias
         float fringe = 0.7; //bokeh chromatic aberration/fringing
 
-        bool noise = true; //use noise instead of pattern for sample dithering
+        const bool noise = DOF_NOISE; //use noise instead of pattern for sample dithering
         float namount = 0.1; //dither amount
 
-        bool depthblur = false; //blur the depth buffer?
+        const bool depthblur = DOF_DEPTH_BLUR; //blur the depth buffer?
         float dbsize = 1.25; //depthblursize
 
         /*
@@ -149,46 +149,10 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
         looks okay starting from samples = 4, rings = 4
         */
 
-        bool pentagon = false; //use pentagon as bokeh shape?
-        float feather = 0.4; //pentagon shape feather
+        const bool pentagon = DOF_PENTAGON; //use pentagon as bokeh shape?
 
         //------------------------------------------
 
-        float penta(vec2 coords) //pentagonal shape
-        {
-            float scale = float(rings) - 1.3;
-            vec4  HS0 = vec4( 1.0,         0.0,         0.0,  1.0);
-            vec4  HS1 = vec4( 0.309016994, 0.951056516, 0.0,  1.0);
-            vec4  HS2 = vec4(-0.809016994, 0.587785252, 0.0,  1.0);
-            vec4  HS3 = vec4(-0.809016994,-0.587785252, 0.0,  1.0);
-            vec4  HS4 = vec4( 0.309016994,-0.951056516, 0.0,  1.0);
-            vec4  HS5 = vec4( 0.0        ,0.0         , 1.0,  1.0);
-            
-            vec4  one = vec4( 1.0 );
-            
-            vec4 P = vec4((coords),vec2(scale, scale)); 
-            
-            vec4 dist = vec4(0.0);
-            float inorout = -4.0;
-            
-            dist.x = dot( P, HS0 );
-            dist.y = dot( P, HS1 );
-            dist.z = dot( P, HS2 );
-            dist.w = dot( P, HS3 );
-            
-            dist = smoothstep( -feather, feather, dist );
-            
-            inorout += dot( dist, one );
-            
-            dist.x = dot( P, HS4 );
-            dist.y = HS5.w - abs( P.z );
-            
-            dist = smoothstep( -feather, feather, dist );
-            inorout += dist.x;
-            
-            return clamp( inorout, 0.0, 1.0 );
-        }
-                                                 
         float bdepth(vec2 coords) //blurring depth
         {
             float d = 0.0;
@@ -216,7 +180,7 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
             
             for( int i=0; i<9; i++ )
             {
-                float tmp = texture2DRect(bgl_NormalDepthTexture, coords + offset[i]).a;
+                float tmp = gbufferLinearDepth(coords + offset[i]);
                 d += tmp * kernel[i];
             }
             
@@ -224,14 +188,19 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
         }
                                                  
                                                  
+        vec4 fetch(vec2 coords) //stays within width x height, the texels past it are left from larger frames
+        {
+            return texture2DRect(bgl_RenderedTexture, clamp(coords, vec2(0.5), vec2(width,height) - vec2(0.5)));
+        }
+        
         vec4 color(vec2 coords,float blur) //processing the sample
         {
             vec4 col = vec4(0.0);
             
-            col.r = texture2DRect(bgl_RenderedTexture,coords + vec2(0.0,1.0)*texel*fringe*blur).r;
-            col.g = texture2DRect(bgl_RenderedTexture,coords + vec2(-0.866,-0.5)*texel*fringe*blur).g;
-            col.b = texture2DRect(bgl_RenderedTexture,coords + vec2(0.866,-0.5)*texel*fringe*blur).b;
-            col.a = texture2DRect(bgl_RenderedTexture,coords).a;
+            col.r = fetch(coords + vec2(0.0,1.0)*texel*fringe*blur).r;
+            col.g = fetch(coords + vec2(-0.866,-0.5)*texel*fringe*blur).g;
+            col.b = fetch(coords + vec2(0.866,-0.5)*texel*fringe*blur).b;
+            col.a = fetch(coords).a;
             
             vec3 lumcoeff = vec3(0.299,0.587,0.114);
             float lum = dot(col.rgb, lumcoeff);
@@ -267,21 +236,21 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
 
         float vignette()
         {
-            float dist = distance(gl_TexCoord[3].xy, vec2(0.5,0.5));
+            float dist = distance(gl_TexCoord[0].xy / vec2(width,height), vec2(0.5,0.5));
             dist = smoothstep(vignout+(fstop/vignfade), vignin+(fstop/vignfade), dist);
             return clamp(dist,0.0,1.0);
         }
                                      
         float linearize(float f)
          {
-             return zfar * f;
+             return u_cameraClip.y * f;
          }
                                      
         void main() 
         {
             //scene depth calculation
             
-            float depth = linearize(texture2DRect(bgl_NormalDepthTexture,gl_TexCoord[0].xy).a);
+            float depth = linearize(gbufferLinearDepth(gl_TexCoord[0].xy));
             
             if (depthblur)
             {
@@ -294,7 +263,7 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
             
             if (autofocus)
             {
-                fDepth = linearize(texture2DRect(bgl_NormalDepthTexture,focus).a);
+                fDepth = linearize(gbufferLinearDepth(focus));
             }
             
             //dof blur factor calculation
@@ -325,7 +294,7 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
             
             // calculation of pattern for ditering
             
-            vec2 noise = rand(gl_TexCoord[0].xy)*namount*blur;
+            vec2 noise = rand(gl_TexCoord[0].xy + noiseOffset)*namount*blur;
             
             // getting blur x and y step factor
             
@@ -344,25 +313,20 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
             {
                 col = texture2DRect(bgl_RenderedTexture, gl_TexCoord[0].xy);
                 float s = 1.0;
-                int ringsamples;
                 
-                for (int i = 1; i <= rings; i += 1)
-                {   
-                    ringsamples = i * samples;
-                    
-                    for (int j = 0 ; j < ringsamples ; j += 1)   
-                    {
-                        float step = PI*2.0 / float(ringsamples);
-                        float pw = (cos(float(j)*step)*float(i));
-                        float ph = (sin(float(j)*step)*float(i));
-                        float p = 1.0;
-                        if (pentagon)
-                        { 
-                            p = penta(vec2(pw,ph));
-                        }
-                        col += color(gl_TexCoord[0].xy + vec2(pw*w,ph*h),blur)*mix(1.0,(float(i))/(float(rings)),bias)*p;
-                        s += 1.0*mix(1.0,(float(i))/(float(rings)),bias)*p;   
-                    }
+                //less rings for smaller blur, the outer ring stays at the full radius
+                int pixelRings = int(clamp(ceil(blur*float(rings)), 1.0, float(rings)));
+                int numTaps = samples * pixelRings * (pixelRings + 1) / 2;
+                vec2 radius = vec2(w,h) * float(rings);
+                
+                for (int t = 0; t < maxTaps; t += 1)
+                {
+                    if (t >= numTaps) break;
+                    vec4 tap = texture2DRect(bokehKernelTex, vec2(float(t) + 0.5, float(pixelRings) - 0.5));
+                    float p = pentagon ? tap.w : 1.0;
+                    vec2 offset = vec2(tap.x*kernelRotation.x - tap.y*kernelRotation.y, tap.x*kernelRotation.y + tap.y*kernelRotation.x);
+                    col += color(gl_TexCoord[0].xy + offset*radius,blur)*tap.z*p;
+                    s += tap.z*p;
                 }
                 col /= s; //divide by sample count
             }
@@ -377,41 +341,415 @@ DofPass::DofPass(const ofVec2f& sz, float focalDepth, float focalLength, float f
                 col.rgb *= vignette();
             }
             
+            if (writeBlur)
+            {
+                col.a = blur;
+            }
+            
             gl_FragColor = col;
         }
     );
     
-    shader.setupShaderFromSource(GL_FRAGMENT_SHADER, fragShaderSrc);
-    shader.linkProgram();
+    shaderSrc = GBuffer::getShaderSource() + fragShaderSrc;
+    activeKey = getPermutationKey();
+    setupShader(permutations[activeKey], getPermutationSources(activeKey));
+    
+    // Brings a low resolution gather back to full resolution. Its texels are
+    // weighted by their depth difference, the blur factor the gather wrote to
+    // alpha decides how much of them replaces the sharp pixel, so in focus
+    // pixels stay sharp with any of the features.
+    string compositeFragShaderSrc = STRINGIFY(
+        uniform sampler2DRect tex;
+        uniform sampler2DRect lowResTex;
+        uniform vec2 lowResScale; // low resolution size / full size
+        
+        const float DEPTH_EPSILON = 0.0001;
+        
+        void main()
+        {
+            vec2 uv = gl_TexCoord[0].xy;
+            vec4 sharp = texture2DRect(tex, uv);
+            float depth = gbufferLinearDepth(uv);
+            
+            vec2 p = uv * lowResScale - vec2(0.5);
+            vec2 base = floor(p);
+            vec2 t = p - base;
+            vec4 sum = vec4(0.0);
+            float weightSum = 0.0;
+            for (int i = 0; i < 4; ++i)
+            {
+                vec2 offset = vec2(float(i - (i / 2) * 2), float(i / 2));
+                vec2 lowResCoord = clamp(base + offset + vec2(0.5), vec2(0.5), u_cameraViewport.zw * lowResScale - vec2(0.5));
+                vec2 bilinear = mix(vec2(1.0) - t, t, offset);
+                float sampleDepth = gbufferLinearDepth(lowResCoord / lowResScale);
+                float weight = bilinear.x * bilinear.y / (DEPTH_EPSILON + abs(depth - sampleDepth));
+                sum += texture2DRect(lowResTex, lowResCoord) * weight;
+                weightSum += weight;
+            }
+            vec4 blurred = sum / max(weightSum, 1e-6);
+            gl_FragColor = vec4(mix(sharp.rgb, blurred.rgb, smoothstep(0.05, 0.15, blurred.a)), sharp.a);
+        }
+    );
+    
+    ShaderCache::Sources sources;
+    sources[GL_FRAGMENT_SHADER] = GBuffer::getShaderHeader() + GBuffer::getShaderSource() + compositeFragShaderSrc;
+    setupShader(compositeShader, sources);
+}
+
+static const float BOKEH_BIAS = 0.5; //bokeh edge bias
+static const float PENTAGON_FEATHER = 0.4; //pentagon shape feather
+
+static inline float smoothstep(float edge0, float edge1, float x) {
+    float t = ofClamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
+    return t * t * (3.0 - 2.0 * t);
+}
+
+// pentagonal shape, coords in units of the first ring
+static float penta(float x, float y, int rings) {
+    static const float planes[5][2] = {
+        { 1.0, 0.0 },
+        { 0.309016994, 0.951056516 },
+        { -0.809016994, 0.587785252 },
+        { -0.809016994, -0.587785252 },
+        { 0.309016994, -0.951056516 }
+    };
+    float scale = rings - 1.3;
+    float inorout = -4.0;
+    for (int i = 0; i < 5; ++i) {
+        inorout += smoothstep(-PENTAGON_FEATHER, PENTAGON_FEATHER, x * planes[i][0] + y * planes[i][1] + scale);
+    }
+    return ofClamp(inorout, 0.0, 1.0);
+}
+
+void DofPass::updateBokehKernel(int samples, int rings)
+{
+    int numTaps = samples * rings * (rings + 1) / 2;
+    bokehKernel.assign(numTaps * rings * 4, 0.f);
+    for (int r = 1; r <= rings; ++r) {
+        float* tap = &bokehKernel[(r - 1) * numTaps * 4];
+        for (int i = 1; i <= r; ++i) {
+            int ringsamples = i * samples;
+            float step = TWO_PI / ringsamples;
+            float weight = ofLerp(1.0, float(i) / r, BOKEH_BIAS);
+            for (int j = 0; j < ringsamples; ++j, tap += 4) {
+                tap[0] = cos(j * step) * i / r;
+                tap[1] = sin(j * step) * i / r;
+                tap[2] = weight;
+                tap[3] = penta(tap[0] * rings, tap[1] * rings, rings);
+            }
+        }
+    }
+    
+    if (backend == BACKEND_GL) {
+        bokehKernelTex.allocate(numTaps, rings, GL_RGBA32F);
+        bokehKernelTex.setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+        bokehKernelTex.loadData(bokehKernel.data(), numTaps, rings, GL_RGBA);
+    }
+    kernelSamples = samples;
+    kernelRings = rings;
+}
+
+// features, samples and rings of the shader the settings ask for
+unsigned DofPass::getPermutationKey() const
+{
+    unsigned key = 0;
+    if (pentagon) key |= FEATURE_PENTAGON;
+    if (vignetting) key |= FEATURE_VIGNETTING;
+    if (manualDof) key |= FEATURE_MANUAL_DOF;
+    if (autofocus) key |= FEATURE_AUTOFOCUS;
+    if (noise) key |= FEATURE_NOISE;
+    if (depthBlur) key |= FEATURE_DEPTH_BLUR;
+    if (showFocus) key |= FEATURE_SHOW_FOCUS;
+    // the focus debug view needs every pixel
+    if (resolution != RESOLUTION_FULL && !showFocus) key |= FEATURE_WRITE_BLUR;
+    unsigned keySamples = ofClamp(samples, 1, 255);
+    unsigned keyRings = ofClamp(rings, 1, 255);
+    return key | keySamples << 16 | keyRings << 24;
+}
+
+ShaderCache::Sources DofPass::getPermutationSources(unsigned key) const
+{
+    stringstream defines;
+    defines << GBuffer::getShaderHeader();
+    defines << boolalpha;
+    defines << "#define DOF_PENTAGON " << bool(key & FEATURE_PENTAGON) << endl;
+    defines << "#define DOF_VIGNETTING " << bool(key & FEATURE_VIGNETTING) << endl;
+    defines << "#define DOF_MANUAL " << bool(key & FEATURE_MANUAL_DOF) << endl;
+    defines << "#define DOF_AUTOFOCUS " << bool(key & FEATURE_AUTOFOCUS) << endl;
+    defines << "#define DOF_NOISE " << bool(key & FEATURE_NOISE) << endl;
+    defines << "#define DOF_DEPTH_BLUR " << bool(key & FEATURE_DEPTH_BLUR) << endl;
+    defines << "#define DOF_SHOW_FOCUS " << bool(key & FEATURE_SHOW_FOCUS) << endl;
+    defines << "#define DOF_WRITE_BLUR " << bool(key & FEATURE_WRITE_BLUR) << endl;
+    defines << "#define DOF_SAMPLES " << ((key >> 16) & 0xff) << endl;
+    defines << "#define DOF_RINGS " << (key >> 24) << endl;
+    
+    ShaderCache::Sources sources;
+    sources[GL_FRAGMENT_SHADER] = defines.str() + shaderSrc;
+    return sources;
+}
+
+// Starts compiling the permutation the settings ask for, and keeps rendering
+// with the last one until it is linked. One that fails to link is dropped and
+// not compiled again, the last one stays.
+ofShader& DofPass::updatePermutation()
+{
+    unsigned key = getPermutationKey();
+    if (key != activeKey && !brokenPermutations.count(key)) {
+        if (!permutations.count(key)) {
+            ShaderCache::Job job;
+            if (ShaderCache::setupAsync(permutations[key], getPermutationSources(key), job)) {
+                pendingPermutations[key] = job;
+            }
+        }
+        auto pending = pendingPermutations.find(key);
+        if (pending == pendingPermutations.end()) {
+            activeKey = key;
+        } else if (ShaderCache::poll(pending->second)) {
+            pendingPermutations.erase(pending);
+            if (ShaderCache::isLinked(permutations[key])) {
+                activeKey = key;
+            } else {
+                ofLogError("DofPass") << "permutation " << hex << key << " failed to link";
+                permutations.erase(key);
+                brokenPermutations.insert(key);
+            }
+        }
+    }
+    
+    int activeSamples = (activeKey >> 16) & 0xff;
+    int activeRings = activeKey >> 24;
+    if (activeSamples != kernelSamples || activeRings != kernelRings) {
+        updateBokehKernel(activeSamples, activeRings);
+    }
+    return permutations[activeKey];
 }
 
 void DofPass::update(ofCamera& cam) {
-    zfar = cam.getFarClip();
-    znear = cam.getNearClip();
+    const CameraData& camera = getCameraData(cam);
+    zfar = camera.getFarClip();
+    jitter = camera.getJitter();
 }
 
 void DofPass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
 {
-    writeFbo.begin();
+    ofShader& shader = updatePermutation();
+    bool lowRes = activeKey & FEATURE_WRITE_BLUR;
+    
+    // the blur target only exists while rendering at low resolution
+    ofFbo* fboLowRes = NULL;
+    // size follows the resolution scale of the Processor, the target stays at full size
+    int lowResWidth = ceil(size.x / resolution);
+    int lowResHeight = ceil(size.y / resolution);
+    if (lowRes) {
+        fboLowRes = &acquireTarget(ceil(fullSize.x / resolution), ceil(fullSize.y / resolution), GL_RGBA);
+        fboLowRes->getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+        fboLowRes->begin();
+    } else {
+        writeFbo.begin();
+    }
     
     shader.begin();
     
     shader.setUniformTexture("bgl_RenderedTexture", readFbo.getTextureReference(), 0);
-    shader.setUniformTexture("bgl_NormalDepthTexture", gbuffer.getTexture(GBuffer::TYPE_NORMAL_DEPTH), 1);
+    gbuffer.setShaderUniforms(shader, 1);
     shader.setUniform1f("bgl_RenderedTextureWidth", size.x);
     shader.setUniform1f("bgl_RenderedTextureHeight", size.y);
+    shader.setUniformTexture("bokehKernelTex", bokehKernelTex, 3);
     
     shader.setUniform1f("focalDepth", focalDepth);  //focal distance value in cm, but you may use autofocus option below
     shader.setUniform1f("focalLength", focalLength); //focal length in cm
     shader.setUniform1f("fstop", fStop); //f-stop value
-    shader.setUniform1f("showFocus", showFocus); //show debug focus point and focal range (red = focal point, green = focal range)
-
-    shader.setUniform1f("znear", znear);
-    shader.setUniform1f("zfar", zfar);
+    if (temporalJitter) {
+        // the jitter sequence sweeps the angle between two taps of the first ring
+        float angle = (jitter.x + 0.5) * TWO_PI / max(samples, 1);
+        shader.setUniform2f("kernelRotation", cos(angle), sin(angle));
+        shader.setUniform2f("noiseOffset", jitter.x, jitter.y);
+    } else {
+        shader.setUniform2f("kernelRotation", 1, 0);
+        shader.setUniform2f("noiseOffset", 0, 0);
+    }
     
     //texturedQuad(0, 0, writeFbo.getWidth(), writeFbo.getHeight());
-    readFbo.draw(0, 0);
+    if (lowRes) {
+        // full resolution texture coordinates over the low resolution target
+        ofClear(0);
+        texturedQuad(0, 0, lowResWidth, lowResHeight, size.x, size.y);
+    } else {
+        texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    }
     
     shader.end();
+    if (!lowRes) {
+        writeFbo.end();
+        return;
+    }
+    fboLowRes->end();
+    
+    writeFbo.begin();
+    compositeShader.begin();
+    compositeShader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    compositeShader.setUniformTexture("lowResTex", fboLowRes->getTextureReference(), 1);
+    gbuffer.setShaderUniforms(compositeShader, 2);
+    compositeShader.setUniform2f("lowResScale", lowResWidth / size.x, lowResHeight / size.y);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    compositeShader.end();
     writeFbo.end();
+    
+    releaseTarget(*fboLowRes);
+}
+
+static inline float fract(float x) {
+    return x - floor(x);
+}
+
+// Same as the shader above, with the features of the settings
+bool DofPass::renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool)
+{
+    const float ndofstart = 1.0;
+    const float ndofdist = 2.0;
+    const float fdofstart = 1.0;
+    const float fdofdist = 3.0;
+    const float CoC = 0.03;
+    const float vignout = 1.3;
+    const float vignin = 0.0;
+    const float vignfade = 22.0;
+    const float maxblur = 1.5;
+    const float threshold = 0.5;
+    const float gain = 2.0;
+    const float fringe = 0.7;
+    const float namount = 0.1;
+    const float dbsize = 1.25;
+    
+    if (max(samples, 1) != kernelSamples || max(rings, 1) != kernelRings) {
+        updateBokehKernel(max(samples, 1), max(rings, 1));
+    }
+    int samples = kernelSamples;
+    int rings = kernelRings;
+    int maxTaps = samples * rings * (rings + 1) / 2;
+    
+    float kernelCos = 1.0;
+    float kernelSin = 0.0;
+    ofVec2f noiseOffset;
+    if (temporalJitter) {
+        float angle = (jitter.x + 0.5) * TWO_PI / samples;
+        kernelCos = cos(angle);
+        kernelSin = sin(angle);
+        noiseOffset = jitter;
+    }
+    
+    const ofFloatPixels& normalDepth = gbuffer.getPixels(GBuffer::TYPE_NORMAL_DEPTH);
+    int w = readPixels.getWidth();
+    int h = readPixels.getHeight();
+    // bdepth(), the g buffer is read nearest
+    auto linearDepth = [&](float u, float v) {
+        return zfar * fetchPixel(normalDepth, floor(u), floor(v))[3];
+    };
+    auto blurredDepth = [&](float u, float v) {
+        static const float kernel[9] = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+        // the third offset of the shader is vec2(wh.x - wh.y), the center
+        static const float offsets[9][2] = { { -1, -1 }, { 0, -1 }, { 0, 0 }, { -1, 0 }, { 0, 0 }, { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+        float d = 0.0;
+        for (int i = 0; i < 9; ++i) {
+            d += linearDepth(u + offsets[i][0] * dbsize, v + offsets[i][1] * dbsize) * kernel[i] / 16.0;
+        }
+        return d;
+    };
+    float fDepth = autofocus ? linearDepth(w * 0.5, h * 0.5) : focalDepth;
+    pool.parallelForTiles(w, h, 32, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            float* out = writePixels.getData() + (y * w + x0) * 4;
+            for (int x = x0; x < x1; ++x, out += 4) {
+                float u = x + 0.5f;
+                float v = y + 0.5f;
+                float depth = depthBlur ? blurredDepth(u, v) : zfar * fetchPixel(normalDepth, x, y)[3];
+                
+                float blur;
+                if (manualDof) {
+                    float a = depth - fDepth;
+                    blur = a > 0.0 ? (a - fdofstart) / fdofdist : (-a - ndofstart) / ndofdist;
+                } else {
+                    float f = focalLength;
+                    float d = fDepth * 10.0;
+                    float o = depth * 10.0;
+                    float a = (o * f) / (o - f);
+                    float b = (d * f) / (d - f);
+                    float c = (d - f) / (d * fStop * CoC);
+                    blur = fabs(a - b) * c;
+                }
+                blur = ofClamp(blur, 0.0, 1.0);
+                
+                const float* src = fetchPixel(readPixels, x, y);
+                float col[4] = { src[0], src[1], src[2], src[3] };
+                if (blur >= 0.05) {
+                    float nu = u + noiseOffset.x;
+                    float nv = v + noiseOffset.y;
+                    float noiseX, noiseY;
+                    if (noise) {
+                        noiseX = fract(sin(nu * 12.9898f + nv * 78.233f) * 43758.5453f) * 2.0 - 1.0;
+                        noiseY = fract(sin(nu * 25.9796f + nv * 156.466f) * 43758.5453f) * 2.0 - 1.0;
+                    } else {
+                        noiseX = (fract(1.0 - nu * (w / 2.0)) * 0.25 + fract(nv * (h / 2.0)) * 0.75) * 2.0 - 1.0;
+                        noiseY = (fract(1.0 - nu * (w / 2.0)) * 0.75 + fract(nv * (h / 2.0)) * 0.25) * 2.0 - 1.0;
+                    }
+                    float bw = (blur * maxblur + noiseX * namount * blur) * rings;
+                    float bh = (blur * maxblur + noiseY * namount * blur) * rings;
+                    int pixelRings = ofClamp(ceil(blur * rings), 1, rings);
+                    int numTaps = samples * pixelRings * (pixelRings + 1) / 2;
+                    const float* t = &bokehKernel[(pixelRings - 1) * maxTaps * 4];
+                    float s = 1.0;
+                    float tap[4];
+                    for (int i = 0; i < numTaps; ++i, t += 4) {
+                        float p = pentagon ? t[3] : 1.0;
+                        float tu = u + (t[0] * kernelCos - t[1] * kernelSin) * bw;
+                        float tv = v + (t[0] * kernelSin + t[1] * kernelCos) * bh;
+                        float rgb[3];
+                        samplePixel(readPixels, tu, tv + fringe * blur, tap);
+                        rgb[0] = tap[0];
+                        samplePixel(readPixels, tu - 0.866f * fringe * blur, tv - 0.5f * fringe * blur, tap);
+                        rgb[1] = tap[1];
+                        samplePixel(readPixels, tu + 0.866f * fringe * blur, tv - 0.5f * fringe * blur, tap);
+                        rgb[2] = tap[2];
+                        float lum = rgb[0] * 0.299f + rgb[1] * 0.587f + rgb[2] * 0.114f;
+                        float thresh = max((lum - threshold) * gain, 0.0f);
+                        samplePixel(readPixels, tu, tv, tap);
+                        for (int ch = 0; ch < 3; ++ch) {
+                            col[ch] += (rgb[ch] + rgb[ch] * thresh * blur) * t[2] * p;
+                        }
+                        col[3] += tap[3] * t[2] * p;
+                        s += t[2] * p;
+                    }
+                    for (int ch = 0; ch < 4; ++ch) {
+                        col[ch] /= s;
+                    }
+                }
+                
+                if (showFocus) {
+                    float edge = 0.002 * depth;
+                    float m = ofClamp(edge > 0 ? ofMap(blur, 0.0, edge, 0.0, 1.0, true) : 1.0, 0.0, 1.0);
+                    m = m * m * (3.0 - 2.0 * m);
+                    float e = ofClamp(edge > 0 ? ofMap(blur, 1.0 - edge, 1.0, 0.0, 1.0, true) : 1.0, 0.0, 1.0);
+                    e = e * e * (3.0 - 2.0 * e);
+                    const float focusColor[3] = { 1.0, 0.5, 0.0 };
+                    const float rangeColor[3] = { 0.0, 0.5, 1.0 };
+                    for (int ch = 0; ch < 3; ++ch) {
+                        col[ch] = ofLerp(col[ch], focusColor[ch], (1.0 - m) * 0.6);
+                        col[ch] = ofLerp(col[ch], rangeColor[ch], ((1.0 - e) - (1.0 - m)) * 0.2);
+                    }
+                }
+                
+                if (vignetting) {
+                    float dist = ofVec2f(u / w, v / h).distance(ofVec2f(0.5, 0.5));
+                    dist = ofClamp(smoothstep(vignout + fStop / vignfade, vignin + fStop / vignfade, dist), 0.0, 1.0);
+                    for (int ch = 0; ch < 3; ++ch) {
+                        col[ch] *= dist;
+                    }
+                }
+                
+                for (int ch = 0; ch < 4; ++ch) {
+                    out[ch] = col[ch];
+                }
+            }
+        }
+    });
+    return true;
 }
@@ -44,10 +44,18 @@ namespace DeferredEffect
     public:
         typedef shared_ptr<DofPass> Ptr;
         
+        // resolution of the bokeh gather, lower ones are upsampled with the depth
+        enum Resolution {
+            RESOLUTION_FULL = 1,
+            RESOLUTION_HALF = 2,
+            RESOLUTION_QUARTER = 4
+        };
+        
         DofPass(const ofVec2f& sz, float focalDepth = 500.f, float focalLength = 50.f, float fStop = 3.f, bool showFocus = false);
                 
         void update(ofCamera& cam);
         void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool);
         
         float& getFocalDepthRef() { return focalDepth; }
         float getFocalDepth() const { return focalDepth; }
@@ -65,14 +73,108 @@ namespace DeferredEffect
         bool getShowFocus() const { return showFocus; }
         void setShowFocus(bool showFocus) { this->showFocus = showFocus; }
         
+        // BACKEND_GL only, showFocus always renders at full resolution
+        void setResolution(Resolution resolution) { this->resolution = resolution; }
+        Resolution getResolution() const { return resolution; }
+        
+        // bokeh taps : samples on the first ring, i * samples on the ring i.
+        // Pixels with a small circle of confusion only walk the inner rings.
+        int& getSamplesRef() { return samples; }
+        int getSamples() const { return samples; }
+        void setSamples(int samples) { this->samples = samples; }
+        
+        int& getRingsRef() { return rings; }
+        int getRings() const { return rings; }
+        void setRings(int rings) { this->rings = rings; }
+        
+        // Shader features. Each combination is its own shader permutation, compiled
+        // on first use; the pass keeps the previous one until it is linked.
+        bool& getPentagonRef() { return pentagon; }
+        bool getPentagon() const { return pentagon; }
+        void setPentagon(bool pentagon) { this->pentagon = pentagon; }
+        
+        bool& getVignettingRef() { return vignetting; }
+        bool getVignetting() const { return vignetting; }
+        void setVignetting(bool vignetting) { this->vignetting = vignetting; }
+        
+        // blur from the near and far dof distances of the shader instead of the lens
+        bool& getManualDofRef() { return manualDof; }
+        bool getManualDof() const { return manualDof; }
+        void setManualDof(bool manualDof) { this->manualDof = manualDof; }
+        
+        // focus on the depth at the center of the screen instead of the focal depth
+        bool& getAutofocusRef() { return autofocus; }
+        bool getAutofocus() const { return autofocus; }
+        void setAutofocus(bool autofocus) { this->autofocus = autofocus; }
+        
+        // dither the taps with noise instead of a pattern
+        bool& getNoiseRef() { return noise; }
+        bool getNoise() const { return noise; }
+        void setNoise(bool noise) { this->noise = noise; }
+        
+        bool& getDepthBlurRef() { return depthBlur; }
+        bool getDepthBlur() const { return depthBlur; }
+        void setDepthBlur(bool depthBlur) { this->depthBlur = depthBlur; }
+        
+        // BACKEND_GL, turns the bokeh kernel and moves the dither with the camera jitter
+        // of every frame, see Processor::setJitterEnabled(). A TemporalAccumulationPass
+        // after it then converges few samples and rings to a smooth bokeh. Off by default
+        bool& getTemporalJitterRef() { return temporalJitter; }
+        bool getTemporalJitter() const { return temporalJitter; }
+        void setTemporalJitter(bool temporalJitter) { this->temporalJitter = temporalJitter; }
+        
     private:
-        ofShader shader;
+        // permutation key bits, samples and rings go in the upper bytes
+        enum Feature {
+            FEATURE_PENTAGON = 1 << 0,
+            FEATURE_VIGNETTING = 1 << 1,
+            FEATURE_MANUAL_DOF = 1 << 2,
+            FEATURE_AUTOFOCUS = 1 << 3,
+            FEATURE_NOISE = 1 << 4,
+            FEATURE_DEPTH_BLUR = 1 << 5,
+            FEATURE_SHOW_FOCUS = 1 << 6,
+            FEATURE_WRITE_BLUR = 1 << 7
+        };
+        
+        void updateBokehKernel(int samples, int rings);
+        unsigned getPermutationKey() const;
+        ShaderCache::Sources getPermutationSources(unsigned key) const;
+        ofShader& updatePermutation();
+        
+        string shaderSrc;
+        map<unsigned, ofShader> permutations;
+        map<unsigned, ShaderCache::Job> pendingPermutations;
+        set<unsigned> brokenPermutations;
+        unsigned activeKey;
         float focalDepth; //focal distance value in meters, but you may use autofocus option below
         float focalLength; //focal length in cm
         float fStop; //f-stop value
         bool showFocus; //show debug focus point and focal range (red = focal point, green = focal range
         
-        float znear;
+        // for renderCpu(), the shaders read u_cameraClip
         float zfar;
+        
+        Resolution resolution;
+        ofShader compositeShader;
+        
+        int samples;
+        int rings;
+        bool pentagon;
+        bool vignetting;
+        bool manualDof;
+        bool autofocus;
+        bool noise;
+        bool depthBlur;
+        bool temporalJitter;
+        // CameraData::getJitter() of this frame
+        ofVec2f jitter;
+        
+        // Row r - 1 holds the taps of a bokeh with r rings, ring by ring :
+        // offset (x, y) on the unit disc, ring weight (z) and pentagon shape (w).
+        // Rebuilt when samples or rings change.
+        vector<float> bokehKernel;
+        ofTexture bokehKernelTex;
+        int kernelSamples;
+        int kernelRings;
     };
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "FrameEncoder.h"
+
+using namespace DeferredEffect;
+
+void FrameEncoder::setup(const string& directory, Format format, int numThreads)
+{
+    wait();
+    this->directory = directory;
+    this->format = format;
+    numFrames = 0;
+    ofDirectory::createDirectory(directory, true, true);
+    pool.setup(numThreads);
+}
+
+void FrameEncoder::add(const FrameReadback::Frame& frame)
+{
+    if (frame.type != getReadbackType()) {
+        ofLogError("FrameEncoder") << "frame type doesn't match the format";
+        return;
+    }
+    {
+        unique_lock<mutex> guard(lock);
+        written.wait(guard, [&] { return numQueued < maxQueuedFrames; });
+        numQueued++;
+    }
+    
+    int channels = frame.format == GL_RGB ? 3 : 4;
+    string path = getPath(numFrames++);
+    if (format == FORMAT_EXR) {
+        shared_ptr<ofFloatPixels> pixels(new ofFloatPixels());
+        pixels->setFromPixels(reinterpret_cast<const float*>(frame.pixels), frame.width, frame.height, channels);
+        pool.submit([this, pixels, path] {
+            if (!ofSaveImage(*pixels, path)) ofLogError("FrameEncoder") << "couldn't write " << path;
+            lock_guard<mutex> guard(lock);
+            numQueued--;
+            written.notify_all();
+        });
+    } else {
+        shared_ptr<ofPixels> pixels(new ofPixels());
+        pixels->setFromPixels(frame.pixels, frame.width, frame.height, channels);
+        pool.submit([this, pixels, path] {
+            if (!ofSaveImage(*pixels, path)) ofLogError("FrameEncoder") << "couldn't write " << path;
+            lock_guard<mutex> guard(lock);
+            numQueued--;
+            written.notify_all();
+        });
+    }
+}
+
+void FrameEncoder::wait()
+{
+    unique_lock<mutex> guard(lock);
+    written.wait(guard, [&] { return numQueued == 0; });
+}
+
+string FrameEncoder::getPath(unsigned index) const
+{
+    string extension = format == FORMAT_EXR ? ".exr" : ".png";
+    return ofToDataPath(directory + "/" + ofToString(index, 5, '0') + extension, true);
+}
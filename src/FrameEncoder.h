@@ -0,0 +1,56 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+#include "FrameReadback.h"
+#include "ThreadPool.h"
+
+namespace DeferredEffect {
+
+    // Saves frames as a numbered image sequence, encoded on a thread pool.
+    // add() copies the pixels and returns, unless getMaxQueuedFrames() are still
+    // waiting to be written, then it waits for one, which bounds the memory.
+    class FrameEncoder {
+    public:
+        enum Format {
+            FORMAT_PNG, // 8 bit
+            FORMAT_EXR  // 32 bit float
+        };
+
+        FrameEncoder() : format(FORMAT_PNG), maxQueuedFrames(8), numQueued(0), numFrames(0) {}
+        ~FrameEncoder() { wait(); }
+
+        // frames go to directory/00000.png etc. relative to the data folder.
+        // 0 threads means one per hardware thread
+        void setup(const string& directory, Format format = FORMAT_PNG, int numThreads = 0);
+        Format getFormat() const { return format; }
+        // what FrameReadback::setFormat() needs for this format
+        GLenum getReadbackType() const { return format == FORMAT_EXR ? GL_FLOAT : GL_UNSIGNED_BYTE; }
+
+        void setMaxQueuedFrames(int frames) { maxQueuedFrames = max(frames, 1); }
+        int getMaxQueuedFrames() const { return maxQueuedFrames; }
+
+        // frame.type has to be getReadbackType(), GL_RGB or GL_RGBA
+        void add(const FrameReadback::Frame& frame);
+        // returns once every added frame is written
+        void wait();
+
+        // frames added since setup(), the number of the next file
+        unsigned getNumFrames() const { return numFrames; }
+
+    private:
+        string getPath(unsigned index) const;
+
+        string directory;
+        Format format;
+        int maxQueuedFrames;
+        mutex lock;
+        condition_variable written;
+        int numQueued;
+        unsigned numFrames;
+        // last, its workers are joined before the rest goes
+        ThreadPool pool;
+    };
+
+}
@@ -0,0 +1,196 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "FrameReadback.h"
+
+using namespace DeferredEffect;
+
+void FrameReadback::readback(ofTexture& texture)
+{
+    if (!GLEW_ARB_sync) {
+        ofLogError("FrameReadback") << "ARB_sync is not supported";
+        return;
+    }
+    int w = texture.getWidth();
+    int h = texture.getHeight();
+    if (w != width || h != height || slots.empty()) {
+        allocate(w, h);
+    }
+    
+    deliver();
+    
+    int index = -1;
+    for (int i = 0; i < slots.size(); ++i) {
+        if (slots[i].state == STATE_FREE) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0 && waitWhenFull && callback) {
+        waitForOldest();
+        deliver();
+        for (int i = 0; i < slots.size() && index < 0; ++i) {
+            if (slots[i].state == STATE_FREE) index = i;
+        }
+    }
+    if (index < 0) {
+        numDropped++;
+        return;
+    }
+    
+    // the copy goes into the buffer, glGetTexImage returns right away
+    Slot& slot = slots[index];
+    GLint packAlignment;
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    GLenum target = texture.getTextureData().textureTarget;
+    glBindTexture(target, texture.getTextureData().textureID);
+    glGetTexImage(target, 0, format, type, 0);
+    glBindTexture(target, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frameNum = ofGetFrameNum();
+    slot.state = STATE_PENDING;
+    queue.push_back(index);
+    
+    deliver();
+}
+
+void FrameReadback::flush()
+{
+    if (!callback) return;
+    while (!queue.empty()) {
+        waitForOldest();
+        deliver();
+        if (!queue.empty() && slots[queue.front()].state != STATE_PENDING) break; // mapping failed
+    }
+}
+
+bool FrameReadback::mapFrame(Frame& frame)
+{
+    poll();
+    if (queue.empty()) return false;
+    Slot& slot = slots[queue.front()];
+    if (slot.state != STATE_READY) return false;
+    
+    frame.pixels = map(slot);
+    if (!frame.pixels) return false;
+    frame.width = width;
+    frame.height = height;
+    frame.format = format;
+    frame.type = type;
+    frame.frameNum = slot.frameNum;
+    slot.state = STATE_MAPPED;
+    return true;
+}
+
+void FrameReadback::unmapFrame()
+{
+    if (queue.empty()) return;
+    Slot& slot = slots[queue.front()];
+    if (slot.state != STATE_MAPPED) return;
+    
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.state = STATE_FREE;
+    queue.pop_front();
+}
+
+void FrameReadback::clear()
+{
+    for (auto& slot : slots) {
+        if (slot.state == STATE_MAPPED) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        if (slot.fence) glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
+    }
+    slots.clear();
+    queue.clear();
+    width = height = 0;
+}
+
+void FrameReadback::allocate(int width, int height)
+{
+    clear();
+    this->width = width;
+    this->height = height;
+    slots.resize(depth);
+    for (auto& slot : slots) {
+        glGenBuffers(1, &slot.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, getFrameSize(), NULL, GL_STREAM_READ);
+        slot.fence = 0;
+        slot.frameNum = 0;
+        slot.state = STATE_FREE;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// in readback order, a frame can't finish before the ones queued earlier
+void FrameReadback::poll()
+{
+    for (int index : queue) {
+        Slot& slot = slots[index];
+        if (slot.state != STATE_PENDING) continue;
+        // zero timeout, the flush makes sure the fence gets to the gpu at all
+        GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+        slot.state = STATE_READY;
+    }
+}
+
+void FrameReadback::waitForOldest()
+{
+    if (queue.empty()) return;
+    Slot& slot = slots[queue.front()];
+    if (slot.state != STATE_PENDING) return;
+    glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+}
+
+void FrameReadback::deliver()
+{
+    if (!callback) {
+        poll();
+        return;
+    }
+    Frame frame;
+    while (mapFrame(frame)) {
+        callback(frame);
+        unmapFrame();
+    }
+}
+
+const unsigned char* FrameReadback::map(Slot& slot)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, getFrameSize(), GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return static_cast<const unsigned char*>(pixels);
+}
+
+size_t FrameReadback::getFrameSize() const
+{
+    int channels = 4;
+    switch (format) {
+        case GL_RED: channels = 1; break;
+        case GL_RG: channels = 2; break;
+        case GL_RGB:
+        case GL_BGR: channels = 3; break;
+    }
+    int bytes = 1;
+    switch (type) {
+        case GL_HALF_FLOAT: bytes = 2; break;
+        case GL_FLOAT: bytes = 4; break;
+    }
+    return size_t(width) * height * channels * bytes;
+}
@@ -0,0 +1,91 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // Reads textures back to the cpu without stalling the render thread.
+    // Every readback() copies into the next of getDepth() pixel buffer objects and
+    // places a fence behind the copy, a frame is handed out once its fence has
+    // signaled, usually depth - 1 frames later. The pixels are never copied on the
+    // cpu side, the buffer stays mapped while the callback runs or until unmapFrame().
+    // When every buffer is still in flight the new frame is dropped instead of waited
+    // for, unless setWaitWhenFull(true) e.g. for offline rendering.
+    class FrameReadback {
+    public:
+        struct Frame {
+            const unsigned char* pixels;
+            int width, height;
+            GLenum format, type;
+            uint64_t frameNum; // ofGetFrameNum() of the readback
+        };
+        // runs on the render thread, copy the pixels to keep them
+        typedef function<void(const Frame& frame)> Callback;
+
+        FrameReadback() : depth(3), format(GL_RGBA), type(GL_UNSIGNED_BYTE), width(0), height(0), waitWhenFull(false), numDropped(0) {}
+        ~FrameReadback() { clear(); }
+
+        // the buffers are reallocated by the next readback()
+        void setDepth(int depth) { clear(); this->depth = max(depth, 2); }
+        int getDepth() const { return depth; }
+        // GL_RGBA / GL_UNSIGNED_BYTE by default
+        void setFormat(GLenum format, GLenum type) { clear(); this->format = format; this->type = type; }
+        GLenum getFormat() const { return format; }
+        GLenum getType() const { return type; }
+        
+        // with a callback, block on the oldest frame rather than drop the new one
+        void setWaitWhenFull(bool waitWhenFull) { this->waitWhenFull = waitWhenFull; }
+        bool getWaitWhenFull() const { return waitWhenFull; }
+
+        // every finished frame goes to callback, otherwise use mapFrame()
+        void setCallback(Callback callback) { this->callback = callback; }
+
+        // queues the copy of texture, then hands out the finished frames
+        void readback(ofTexture& texture);
+        // without a callback : the oldest finished frame, false if there is none yet.
+        // frame.pixels is valid until unmapFrame()
+        bool mapFrame(Frame& frame);
+        void unmapFrame();
+        // with a callback : blocks until every queued frame went to it
+        void flush();
+
+        // frames skipped because all buffers were in flight
+        unsigned getNumDropped() const { return numDropped; }
+
+        void clear();
+
+    private:
+        enum State {
+            STATE_FREE,
+            STATE_PENDING, // copy queued, fence not signaled yet
+            STATE_READY,
+            STATE_MAPPED
+        };
+        struct Slot {
+            GLuint pbo;
+            GLsync fence;
+            uint64_t frameNum;
+            State state;
+        };
+
+        void allocate(int width, int height);
+        void poll();
+        void waitForOldest();
+        void deliver();
+        const unsigned char* map(Slot& slot);
+        size_t getFrameSize() const;
+
+        int depth;
+        GLenum format, type;
+        int width, height;
+        bool waitWhenFull;
+        vector<Slot> slots;
+        // slot indices in readback order
+        deque<int> queue;
+        Callback callback;
+        unsigned numDropped;
+    };
+
+}
@@ -3,6 +3,7 @@
 //
 
 #include "GBuffer.h"
+#include "ShaderCache.h"
 
 using namespace DeferredEffect;
 
@@ -11,35 +12,58 @@ using namespace DeferredEffect;
 // Note : This class is thread unsafe.
 string gbufferVertShader = STRINGIFY
 (
- uniform mat4 invCurrentMvpMat;
- uniform mat4 prevMvpMat;
  uniform mat4 invCurrentTransformMat;
  uniform mat4 prevTransformMat;
- uniform float farClip;
+ // GBufferBatch : model and previous model matrix columns of every instance
+ uniform bool u_instanced;
+ uniform sampler2DRect u_instanceTex;
  varying float v_depth;
  varying vec3 v_normal;
  varying vec2 v_texCoord;
  varying vec2 v_velocity;
  
+ // offset 0 : model matrix, 4 : previous model matrix
+ mat4 instanceMatrix(int offset)
+ {
+     int texel = gl_InstanceIDARB * 8 + offset;
+     ivec2 coord = ivec2(texel % INSTANCE_TEX_WIDTH, texel / INSTANCE_TEX_WIDTH);
+     return mat4(texelFetch2DRect(u_instanceTex, coord),
+                 texelFetch2DRect(u_instanceTex, coord + ivec2(1, 0)),
+                 texelFetch2DRect(u_instanceTex, coord + ivec2(2, 0)),
+                 texelFetch2DRect(u_instanceTex, coord + ivec2(3, 0)));
+ }
+ 
  void main()
  {
-     mat4 postTransformMatrix = invCurrentTransformMat * invCurrentMvpMat * gl_ModelViewProjectionMatrix;
-     gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+     vec4 vertex = gl_Vertex;
+     vec3 normal = gl_Normal;
+     vec4 prevVertex;
+     if (u_instanced) {
+         // the batch is drawn with the camera matrices only
+         mat4 model = instanceMatrix(0);
+         vertex = model * gl_Vertex;
+         normal = mat3(model) * gl_Normal;
+         prevVertex = instanceMatrix(4) * gl_Vertex;
+     } else {
+         mat4 postTransformMatrix = invCurrentTransformMat * u_cameraInverseModelViewProjection * gl_ModelViewProjectionMatrix;
+         prevVertex = prevTransformMat * postTransformMatrix * gl_Vertex;
+     }
+     gl_Position = gl_ModelViewProjectionMatrix * vertex;
      vec4 currentPosition = gl_Position;
-     vec4 prevPosition = prevMvpMat * prevTransformMat * postTransformMatrix * gl_Vertex;
+     vec4 prevPosition = u_cameraPrevModelViewProjection * prevVertex;
      currentPosition.xyz = currentPosition.xyz / currentPosition.w;
      prevPosition.xyz = prevPosition.xyz / prevPosition.w;
      
-     // half spread velocity
-     vec2 velocity = (currentPosition.xy - prevPosition.xy) * 0.5;
+     // half spread velocity, without the sub-pixel jitter of the projections
+     vec2 velocity = ((currentPosition.xy - u_cameraJitter.xy) - (prevPosition.xy - u_cameraJitter.zw)) * 0.5;
      velocity.y = -velocity.y;
      
      // velocity encoding :
      // http://www.crytek.com/download/Sousa_Graphics_Gems_CryENGINE3.pdf
      velocity = sign(velocity) * sqrt(abs(velocity)) * 127.0 / 255.0 + vec2(127.0/255.0);
-     vec4 viewPos = gl_ModelViewMatrix * gl_Vertex;
-     v_depth = -viewPos.z / farClip;
-     v_normal = gl_NormalMatrix * gl_Normal;
+     vec4 viewPos = gl_ModelViewMatrix * vertex;
+     v_depth = -viewPos.z / u_cameraClip.y;
+     v_normal = gl_NormalMatrix * normal;
      v_texCoord = gl_MultiTexCoord0.st;
      v_velocity = velocity;
      
@@ -47,6 +71,77 @@ string gbufferVertShader = STRINGIFY
  }
  );
 
+// Included by every shader that reads the normal and depth, hides the layout.
+// Compact layouts keep an octahedral normal in rg and rebuild the linear depth
+// from the perspective depth attachment.
+string gbufferShaderSource = STRINGIFY
+(
+ uniform sampler2DRect u_gbufferNormalDepthTex;
+ uniform sampler2DRect u_gbufferDepthTex;
+ uniform int u_gbufferLayout; // GBuffer::Layout
+ 
+ vec2 gbufferSignNotZero(vec2 v)
+ {
+     return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+ }
+ 
+ vec2 gbufferEncodeNormal(vec3 n)
+ {
+     n /= abs(n.x) + abs(n.y) + abs(n.z);
+     vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * gbufferSignNotZero(n.xy);
+     return e * 0.5 + 0.5;
+ }
+ 
+ vec3 gbufferDecodeNormal(vec2 e)
+ {
+     e = e * 2.0 - 1.0;
+     vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+     if (n.z < 0.0) {
+         n.xy = (1.0 - abs(n.yx)) * gbufferSignNotZero(n.xy);
+     }
+     return normalize(n);
+ }
+ 
+ // within u_cameraViewport, the texels past it are left from larger frames
+ vec2 gbufferClamp(vec2 texCoord)
+ {
+     return clamp(texCoord, u_cameraViewport.xy + vec2(0.5), u_cameraViewport.xy + u_cameraViewport.zw - vec2(0.5));
+ }
+ 
+ // pixels along the rows and columns of the targets the surface moved since the
+ // frame before, from the encoded TYPE_VELOCITY of a viewport of that size. The
+ // g buffer velocity is half the ndc spread, square root encoded around 127.
+ vec2 gbufferDecodeVelocity(vec2 v, vec2 viewport)
+ {
+     vec2 e = (v - vec2(127.0/255.0)) * (255.0/127.0);
+     return e * abs(e) * viewport;
+ }
+ 
+ // view space depth / far clip
+ float gbufferLinearDepth(vec2 texCoord)
+ {
+     texCoord = gbufferClamp(texCoord);
+     if (u_gbufferLayout == 0) {
+         return texture2DRect(u_gbufferNormalDepthTex, texCoord).a;
+     }
+     float z = texture2DRect(u_gbufferDepthTex, texCoord).r * 2.0 - 1.0;
+     float n = u_cameraClip.x;
+     float f = u_cameraClip.y;
+     return 2.0 * n / (f + n - z * (f - n));
+ }
+ 
+ // view space normal
+ vec3 gbufferNormal(vec2 texCoord)
+ {
+     texCoord = gbufferClamp(texCoord);
+     vec4 v = texture2DRect(u_gbufferNormalDepthTex, texCoord);
+     if (u_gbufferLayout == 0) {
+         return v.xyz;
+     }
+     return gbufferDecodeNormal(v.xy);
+ }
+ );
+
 string gbufferFragShader = STRINGIFY
 (
  uniform sampler2DRect tex;
@@ -59,8 +154,13 @@ string gbufferFragShader = STRINGIFY
  void main()
  {
      vec3 diffuse = texture2DRect(tex, v_texCoord.st).rgb;
+     vec3 normal = normalize(v_normal);
      gl_FragData[0] = mix(gl_Color, gl_Color * vec4(diffuse, 1.0), texFlag); // albedo
-     gl_FragData[1] = vec4(normalize(v_normal),  v_depth); // normal + depth
+     if (u_gbufferLayout == 0) {
+         gl_FragData[1] = vec4(normal, v_depth); // normal + depth
+     } else {
+         gl_FragData[1] = vec4(gbufferEncodeNormal(normal), 0.0, 1.0); // normal, depth is in the depth attachment
+     }
      gl_FragData[2] = vec4(v_velocity.x, v_velocity.y, 0.0, 1.0); // velocity
  }
  );
@@ -68,10 +168,9 @@ string gbufferFragShader = STRINGIFY
 
 string alphaFragShader = STRINGIFY
 (
- uniform sampler2DRect tex;
  void main()
  {
-     gl_FragColor = vec4(vec3(texture2DRect(tex, gl_TexCoord[0].xy).a), 1.0);
+     gl_FragColor = vec4(vec3(gbufferLinearDepth(gl_TexCoord[0].xy)), 1.0);
  }
 );
 
@@ -96,36 +195,137 @@ void GBufferObject::drawToGBuffer(bool autoFlush) {
 }
 
 //======================================================================================
-void GBuffer::setup(int w, int h)
+void GBufferBatch::resize(int numInstances)
 {
+    numInstances = max(numInstances, 0);
+    transforms.resize(numInstances);
+    prevTransforms.resize(numInstances);
+}
+
+void GBufferBatch::flush() {
+    prevTransforms = transforms;
+}
+
+void GBufferBatch::drawToGBuffer(bool autoFlush) {
+    if (transforms.empty()) return;
+    if (!currentShader || !GLEW_ARB_draw_instanced) {
+        // one draw per instance, the same uniforms a GBufferObject sets
+        for (int i = 0; i < transforms.size(); ++i) {
+            if (currentShader) {
+                currentShader->setUniformMatrix4f("prevTransformMat", prevTransforms[i]);
+                currentShader->setUniformMatrix4f("invCurrentTransformMat", transforms[i].getInverse());
+            }
+            ofPushMatrix();
+            ofMultMatrix(transforms[i]);
+            mesh.draw();
+            ofPopMatrix();
+        }
+        if (currentShader) {
+            currentShader->setUniformMatrix4f("prevTransformMat", ofMatrix4x4());
+            currentShader->setUniformMatrix4f("invCurrentTransformMat", ofMatrix4x4());
+        }
+    } else {
+        upload();
+        currentShader->setUniform1i("u_instanced", true);
+        currentShader->setUniformTexture("u_instanceTex", instanceTex, 1);
+        mesh.drawInstanced(OF_MESH_FILL, transforms.size());
+        currentShader->setUniform1i("u_instanced", false);
+    }
+    if (autoFlush) {
+        flush();
+    }
+}
+
+// 8 texels per instance, the columns of the model and the previous model matrix,
+// the same layout setUniformMatrix4f() uploads
+void GBufferBatch::upload()
+{
+    int numInstances = transforms.size();
+    int instancesPerRow = TEXTURE_WIDTH / 8;
+    int w = min(numInstances, instancesPerRow) * 8;
+    int h = (numInstances + instancesPerRow - 1) / instancesPerRow;
+    texels.resize(TEXTURE_WIDTH * h * 4);
+    for (int i = 0; i < numInstances; ++i) {
+        float* texel = &texels[((i / instancesPerRow) * w + (i % instancesPerRow) * 8) * 4];
+        memcpy(texel, transforms[i].getPtr(), 16 * sizeof(float));
+        memcpy(texel + 16, prevTransforms[i].getPtr(), 16 * sizeof(float));
+    }
+    if (!instanceTex.isAllocated() || instanceTex.getWidth() < w || instanceTex.getHeight() < h) {
+        instanceTex.allocate(w, h, GL_RGBA32F_ARB, true);
+        instanceTex.setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    }
+    instanceTex.loadData(&texels[0], w, h, GL_RGBA);
+}
+
+//======================================================================================
+string GBuffer::getShaderSource()
+{
+    return CameraData::getShaderSource() + gbufferShaderSource;
+}
+
+string GBuffer::getShaderHeader()
+{
+    stringstream header;
+    header << "#version 120" << endl;
+    header << "#extension GL_EXT_gpu_shader4 : enable" << endl;
+    header << CameraData::getShaderHeader();
+    return header.str();
+}
+
+void GBuffer::setup(int w, int h, Layout layout)
+{
+    this->layout = layout;
+    
     ofFbo::Settings settings;
     settings.width = w;
     settings.height = h;
     settings.minFilter = GL_NEAREST;
     settings.maxFilter = GL_NEAREST;
     settings.colorFormats.push_back(GL_RGB);           // albedo
-    settings.colorFormats.push_back(GL_RGBA32F_ARB);   // normal + ldepth
+    if (layout == LAYOUT_COMPACT) {
+        settings.colorFormats.push_back(GL_RG16F);     // octahedral normal
+    } else if (layout == LAYOUT_COMPACT_8BIT) {
+        settings.colorFormats.push_back(GL_RG8);       // octahedral normal
+    } else {
+        settings.colorFormats.push_back(GL_RGBA32F_ARB);   // normal + ldepth
+    }
     settings.colorFormats.push_back(GL_RG8);           // velocity
     settings.colorFormats.push_back(GL_RGB);           // light pass
     settings.depthStencilAsTexture = true;
     settings.useDepth = true;
     settings.useStencil = true;
     fbo.allocate(settings);
+    // compact layouts read the depth per pixel
+    fbo.getDepthTexture().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    
+    // gl_InstanceIDARB is 0 without instancing, GBufferBatch draws one by one then
+    stringstream header;
+    header << getShaderHeader();
+    header << "#extension GL_ARB_draw_instanced : enable" << endl;
+    header << "#if !defined(GL_ARB_draw_instanced) && !defined(gl_InstanceIDARB)" << endl;
+    header << "#define gl_InstanceIDARB 0" << endl;
+    header << "#endif" << endl;
+    header << "#define INSTANCE_TEX_WIDTH " << GBufferBatch::TEXTURE_WIDTH << endl;
     
-    shader.setupShaderFromSource(GL_VERTEX_SHADER, gbufferVertShader);
-    shader.setupShaderFromSource(GL_FRAGMENT_SHADER, gbufferFragShader);
-    shader.linkProgram();
+    ShaderCache::Sources sources;
+    sources[GL_VERTEX_SHADER] = header.str() + CameraData::getShaderSource() + gbufferVertShader;
+    sources[GL_FRAGMENT_SHADER] = getShaderHeader() + getShaderSource() + gbufferFragShader;
+    ShaderCache::setup(shader, sources);
     
-    debugShader.setupShaderFromSource(GL_FRAGMENT_SHADER, alphaFragShader);
-    debugShader.linkProgram();
+    sources.clear();
+    sources[GL_FRAGMENT_SHADER] = getShaderHeader() + getShaderSource() + alphaFragShader;
+    ShaderCache::setup(debugShader, sources);
 }
 
 void GBuffer::begin(ofCamera& cam, Mode mode)
 {
-    // update camera first
-    cam.begin();
-    cam.end();
-    
+    ownCamera.update(cam, ofRectangle(0, 0, fbo.getWidth(), fbo.getHeight()));
+    begin(ownCamera, mode);
+}
+
+void GBuffer::begin(CameraData& camera, Mode mode)
+{
+    this->camera = &camera;
     currentShader = &shader;
     fbo.begin();
     
@@ -138,21 +338,30 @@ void GBuffer::begin(ofCamera& cam, Mode mode)
     } else if (mode == MODE_LIGHT) {
         fbo.setActiveDrawBuffer(TYPE_LIGHT_PASS);
     }
-    ofClear(128, 128, 128, 255);
+    if (mode == MODE_LIGHT) {
+        // lights are depth tested against the geometry pass
+        glClearColor(0, 0, 0, 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+    } else {
+        ofClear(128, 128, 128, 255);
+        // the encoded zero velocity, 128 is one step off it
+        const GLfloat zeroVelocity[] = { 127.f / 255.f, 127.f / 255.f, 0.f, 1.f };
+        glClearBufferfv(GL_COLOR, TYPE_VELOCITY, zeroVelocity);
+    }
     ofPushView();
     
-    ofRectangle viewport(0, 0, fbo.getWidth(), fbo.getHeight());
-    ofViewport(viewport);
-    ofSetOrientation(ofGetOrientation(),cam.isVFlipped());
+    // from the first row of the fbo, as the passes read it
+    const ofRectangle& viewport = camera.getViewport();
+    ofViewport(viewport.x, viewport.y, viewport.width, viewport.height, false);
+    ofSetOrientation(ofGetOrientation(), camera.isVFlipped());
     ofSetMatrixMode(OF_MATRIX_PROJECTION);
-    ofLoadMatrix(cam.getProjectionMatrix(viewport));
+    ofLoadMatrix(camera.getProjectionMatrix());
     ofSetMatrixMode(OF_MATRIX_MODELVIEW);
-    ofLoadMatrix(cam.getModelViewMatrix());
+    ofLoadMatrix(camera.getModelViewMatrix());
+    
     shader.begin();
-    shader.setUniform1f("farClip", cam.getFarClip());
-    shader.setUniformMatrix4f("prevMvpMat", prevModelviewProjectionMatrix);
-    shader.setUniformMatrix4f("invCurrentMvpMat", cam.getModelViewProjectionMatrix().getInverse());
-    prevModelviewProjectionMatrix = cam.getModelViewProjectionMatrix();
+    shader.setUniform1i("u_gbufferLayout", layout);
+    camera.bind(shader);
     
     ofPushStyle();
     ofEnableDepthTest();
@@ -184,6 +393,17 @@ void GBuffer::debugDraw()
     fbo.getTextureReference(2).draw(ws*2, hs*3, ws, hs);
     
     debugShader.begin();
+    setShaderUniforms(debugShader, 1);
     fbo.getTextureReference(1).draw(ws*3, hs*3, ws, hs);
     debugShader.end();
 }
+
+// binds the normal / depth textures to firstTextureUnit and the one after it,
+// and the camera the g buffer was drawn with
+void GBuffer::setShaderUniforms(ofShader& s, int firstTextureUnit)
+{
+    s.setUniformTexture("u_gbufferNormalDepthTex", fbo.getTextureReference(TYPE_NORMAL_DEPTH), firstTextureUnit);
+    s.setUniformTexture("u_gbufferDepthTex", fbo.getDepthTexture(), firstTextureUnit + 1);
+    s.setUniform1i("u_gbufferLayout", layout);
+    camera->bind(s);
+}
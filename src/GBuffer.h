@@ -3,6 +3,7 @@
 //
 #pragma once
 #include "ofMain.h"
+#include "CameraData.h"
 
 // Part of this code is from James Acres's of-DeferredRendering
 // https://github.com/jacres/of-DeferredRendering
@@ -23,6 +24,40 @@ namespace DeferredEffect {
     protected:
         virtual void customDraw() = 0;
     };
+    
+    // Many copies of one mesh drawn into the g buffer with a single instanced call.
+    // The current and previous model matrices of all instances are uploaded in one
+    // float texture per draw, the vertex shader computes the velocity per instance.
+    // Draw it with the camera matrices only, normals assume uniform scales.
+    class GBufferBatch
+    {
+    public:
+        // texels per row of the matrix texture, 8 per instance
+        static const int TEXTURE_WIDTH = 1024;
+        
+        void setMesh(const ofMesh& mesh) { this->mesh = mesh; }
+        ofVboMesh& getMeshRef() { return mesh; }
+        
+        // new instances start at the identity, also as their previous transform
+        void resize(int numInstances);
+        int size() const { return transforms.size(); }
+        
+        void setTransform(int index, const ofMatrix4x4& transform) { transforms[index] = transform; }
+        const ofMatrix4x4& getTransform(int index) const { return transforms[index]; }
+        
+        // the current transforms become the previous ones
+        void flush();
+        void drawToGBuffer(bool autoFlush = true);
+        
+    private:
+        void upload();
+        
+        ofVboMesh mesh;
+        vector<ofMatrix4x4> transforms;
+        vector<ofMatrix4x4> prevTransforms;
+        vector<float> texels;
+        ofTexture instanceTex;
+    };
 
 
     class GBuffer
@@ -31,7 +66,6 @@ namespace DeferredEffect {
         ofFbo fbo;
         ofShader shader;
         ofShader debugShader;
-        ofMatrix4x4 prevModelviewProjectionMatrix;
     public:
         enum Mode {
             MODE_GEOMETRY,
@@ -43,17 +77,41 @@ namespace DeferredEffect {
             TYPE_VELOCITY = 2,
             TYPE_LIGHT_PASS = 3
         };
+        // what TYPE_NORMAL_DEPTH holds
+        enum Layout {
+            LAYOUT_STANDARD = 0,   // RGBA32F view space normal + linear depth
+            LAYOUT_COMPACT = 1,    // RG16F octahedral normal, linear depth from the depth attachment
+            LAYOUT_COMPACT_8BIT = 2 // same with RG8 normals
+        };
         
-        GBuffer() {}
+        GBuffer() : layout(LAYOUT_STANDARD), camera(&ownCamera) {}
         
-        void setup(int w = ofGetWidth(), int h = ofGetHeight());
+        void setup(int w = ofGetWidth(), int h = ofGetHeight(), Layout layout = LAYOUT_STANDARD);
+        // updates a CameraData of its own for the size of the g buffer
         void begin(ofCamera& cam, Mode mode = MODE_GEOMETRY);
+        // camera is kept for setShaderUniforms() until the next begin()
+        void begin(CameraData& camera, Mode mode = MODE_GEOMETRY);
         void end();
         void debugDraw();
         ofTexture& getTexture(int index) {
             return fbo.getTextureReference(index);
         }
         ofFbo& getFbo() {return fbo;}
+        Layout getLayout() const { return layout; }
+        
+        // GLSL providing gbufferLinearDepth(texCoord) and gbufferNormal(texCoord) for any layout,
+        // gbufferDecodeVelocity(v, viewport) and the CameraData uniforms. Prepend it to the shader and call setShaderUniforms()
+        // while it is bound.
+        static string getShaderSource();
+        // #version and #extension lines of every shader with getShaderSource(), the very
+        // first lines of it. #define lines of the shader go after it.
+        static string getShaderHeader();
+        void setShaderUniforms(ofShader& shader, int firstTextureUnit);
+        
+    private:
+        Layout layout;
+        CameraData ownCamera;
+        CameraData* camera;
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "LightCuller.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LIGHT_CULLER_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHT_CULLER_SSE
+#endif
+
+using namespace DeferredEffect;
+
+static const size_t SIMD_PADDING = 8;
+
+void LightCuller::resize(size_t n)
+{
+    count = n;
+    size_t padded = (n + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING;
+    x.resize(padded, 0.f);
+    y.resize(padded, 0.f);
+    z.resize(padded, 0.f);
+    r.resize(padded, 0.f);
+    vx.resize(padded);
+    vy.resize(padded);
+    vz.resize(padded);
+    visible.reserve(n);
+}
+
+bool LightCuller::isSimdEnabled()
+{
+#if defined(LIGHT_CULLER_AVX) || defined(LIGHT_CULLER_SSE)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Gribb / Hartmann plane extraction. ofMatrix4x4 multiplies row vectors,
+// so the clip space coordinates are the columns of the projection.
+void LightCuller::setupPlanes(const ofMatrix4x4& p)
+{
+    for (int i = 0; i < 6; ++i) {
+        int axis = i / 2;
+        float sign = (i % 2 == 0) ? 1.f : -1.f;
+        for (int row = 0; row < 4; ++row) {
+            planes[i][row] = p(row, 3) + sign * p(row, axis);
+        }
+        float len = sqrt(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+        if (len > 0) {
+            for (int row = 0; row < 4; ++row) {
+                planes[i][row] /= len;
+            }
+        }
+    }
+}
+
+void LightCuller::cullScalar(const ofMatrix4x4& m, const ofMatrix4x4& projection)
+{
+    setupPlanes(projection);
+    visible.clear();
+    for (size_t i = 0; i < count; ++i) {
+        vx[i] = x[i] * m(0, 0) + y[i] * m(1, 0) + z[i] * m(2, 0) + m(3, 0);
+        vy[i] = x[i] * m(0, 1) + y[i] * m(1, 1) + z[i] * m(2, 1) + m(3, 1);
+        vz[i] = x[i] * m(0, 2) + y[i] * m(1, 2) + z[i] * m(2, 2) + m(3, 2);
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; ++p) {
+            inside = planes[p][0] * vx[i] + planes[p][1] * vy[i] + planes[p][2] * vz[i] + planes[p][3] > -r[i];
+        }
+        if (inside) {
+            visible.push_back(i);
+        }
+    }
+}
+
+#if defined(LIGHT_CULLER_AVX)
+typedef __m256 simd_t;
+static const size_t SIMD_WIDTH = 8;
+static inline simd_t simdSet(float v) { return _mm256_set1_ps(v); }
+static inline simd_t simdLoad(const float* p) { return _mm256_loadu_ps(p); }
+static inline void simdStore(float* p, simd_t v) { _mm256_storeu_ps(p, v); }
+static inline simd_t simdMadd(simd_t a, simd_t b, simd_t c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+static inline simd_t simdSub(simd_t a, simd_t b) { return _mm256_sub_ps(a, b); }
+static inline simd_t simdGreater(simd_t a, simd_t b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline simd_t simdAnd(simd_t a, simd_t b) { return _mm256_and_ps(a, b); }
+static inline int simdMask(simd_t v) { return _mm256_movemask_ps(v); }
+#elif defined(LIGHT_CULLER_SSE)
+typedef __m128 simd_t;
+static const size_t SIMD_WIDTH = 4;
+static inline simd_t simdSet(float v) { return _mm_set1_ps(v); }
+static inline simd_t simdLoad(const float* p) { return _mm_loadu_ps(p); }
+static inline void simdStore(float* p, simd_t v) { _mm_storeu_ps(p, v); }
+static inline simd_t simdMadd(simd_t a, simd_t b, simd_t c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline simd_t simdSub(simd_t a, simd_t b) { return _mm_sub_ps(a, b); }
+static inline simd_t simdGreater(simd_t a, simd_t b) { return _mm_cmpgt_ps(a, b); }
+static inline simd_t simdAnd(simd_t a, simd_t b) { return _mm_and_ps(a, b); }
+static inline int simdMask(simd_t v) { return _mm_movemask_ps(v); }
+#endif
+
+void LightCuller::cull(const ofMatrix4x4& m, const ofMatrix4x4& projection)
+{
+#if defined(LIGHT_CULLER_AVX) || defined(LIGHT_CULLER_SSE)
+    setupPlanes(projection);
+    visible.clear();
+
+    simd_t m00 = simdSet(m(0, 0)), m10 = simdSet(m(1, 0)), m20 = simdSet(m(2, 0)), m30 = simdSet(m(3, 0));
+    simd_t m01 = simdSet(m(0, 1)), m11 = simdSet(m(1, 1)), m21 = simdSet(m(2, 1)), m31 = simdSet(m(3, 1));
+    simd_t m02 = simdSet(m(0, 2)), m12 = simdSet(m(1, 2)), m22 = simdSet(m(2, 2)), m32 = simdSet(m(3, 2));
+    simd_t pa[6], pb[6], pc[6], pd[6];
+    for (int p = 0; p < 6; ++p) {
+        pa[p] = simdSet(planes[p][0]);
+        pb[p] = simdSet(planes[p][1]);
+        pc[p] = simdSet(planes[p][2]);
+        pd[p] = simdSet(planes[p][3]);
+    }
+    simd_t zero = simdSet(0.f);
+
+    for (size_t i = 0; i < count; i += SIMD_WIDTH) {
+        simd_t px = simdLoad(&x[i]);
+        simd_t py = simdLoad(&y[i]);
+        simd_t pz = simdLoad(&z[i]);
+        simd_t tx = simdMadd(px, m00, simdMadd(py, m10, simdMadd(pz, m20, m30)));
+        simd_t ty = simdMadd(px, m01, simdMadd(py, m11, simdMadd(pz, m21, m31)));
+        simd_t tz = simdMadd(px, m02, simdMadd(py, m12, simdMadd(pz, m22, m32)));
+        simdStore(&vx[i], tx);
+        simdStore(&vy[i], ty);
+        simdStore(&vz[i], tz);
+
+        simd_t negRadius = simdSub(zero, simdLoad(&r[i]));
+        simd_t inside = simdGreater(simdMadd(tx, pa[0], simdMadd(ty, pb[0], simdMadd(tz, pc[0], pd[0]))), negRadius);
+        for (int p = 1; p < 6; ++p) {
+            simd_t d = simdMadd(tx, pa[p], simdMadd(ty, pb[p], simdMadd(tz, pc[p], pd[p])));
+            inside = simdAnd(inside, simdGreater(d, negRadius));
+        }
+
+        int bits = simdMask(inside);
+        for (size_t lane = 0; bits; ++lane, bits >>= 1) {
+            if ((bits & 1) && i + lane < count) {
+                visible.push_back(i + lane);
+            }
+        }
+    }
+#else
+    cullScalar(m, projection);
+#endif
+}
@@ -0,0 +1,47 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // Structure of arrays store of point light positions and radii.
+    // cull() transforms all of them to view space (SSE / AVX when available)
+    // and keeps the ones whose bounding sphere intersects the view frustum.
+    class LightCuller {
+    public:
+        LightCuller() : count(0) {}
+
+        void resize(size_t n);
+        size_t size() const { return count; }
+
+        // radius <= 0 means unbounded, such a light is never culled
+        void set(size_t i, const ofVec3f& position, float radius) {
+            x[i] = position.x;
+            y[i] = position.y;
+            z[i] = position.z;
+            r[i] = radius > 0 ? radius : numeric_limits<float>::max();
+        }
+
+        void cull(const ofMatrix4x4& modelView, const ofMatrix4x4& projection);
+        // reference implementation without SIMD
+        void cullScalar(const ofMatrix4x4& modelView, const ofMatrix4x4& projection);
+
+        // indices of the lights that passed the last cull, in ascending order
+        const vector<int>& getVisible() const { return visible; }
+        ofVec3f getViewPosition(int i) const { return ofVec3f(vx[i], vy[i], vz[i]); }
+
+        static bool isSimdEnabled();
+    private:
+        void setupPlanes(const ofMatrix4x4& projection);
+
+        size_t count;
+        // padded to a multiple of the SIMD width
+        vector<float> x, y, z, r;
+        vector<float> vx, vy, vz;
+        vector<int> visible;
+        float planes[6][4];
+    };
+
+}
@@ -6,21 +6,36 @@
 #define STRINGIFY(A) #A
 using namespace DeferredEffect;
 
-static inline void createShaderWithHeader(ofShader& s, const string& str) {
+static inline ShaderCache::Sources sourcesWithHeader(const string& str, const string& vert = "") {
+    string header = GBuffer::getShaderHeader();
+    ShaderCache::Sources sources;
+    if (!vert.empty()) sources[GL_VERTEX_SHADER] = header + vert;
+    sources[GL_FRAGMENT_SHADER] = header + str;
+    return sources;
+}
+
+// work groups of TILE_GROUP_SIZE x TILE_GROUP_SIZE invocations
+static const int TILE_GROUP_SIZE = 16;
+
+// tiles of k pixels covering pixels, the last one may be partial
+static inline int getTileCount(float pixels, float k) {
+    return max(1, int(ceil(pixels / k)));
+}
+
+static inline ShaderCache::Sources computeSources(const string& str) {
     stringstream ss;
-    ss << "#version 120" << endl;
-    ss << "#extension GL_EXT_gpu_shader4 : enable" << endl;
+    ss << "#version 430" << endl;
+    ss << "#define GROUP_SIZE " << TILE_GROUP_SIZE << endl;
+    ss << "layout(local_size_x = GROUP_SIZE, local_size_y = GROUP_SIZE) in;" << endl;
     ss << str;
-    s.setupShaderFromSource(GL_FRAGMENT_SHADER, ss.str());
-    s.linkProgram();
+    ShaderCache::Sources sources;
+    sources[GL_COMPUTE_SHADER] = ss.str();
+    return sources;
 }
 
-MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "MotionBlurPass"), k(k) {
+MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "MotionBlurPass"), k(k), useCompute(false), checkCompute(false) {
     farClip = 1000.0f;
-    fboTileMax.allocate(sz.x / k, sz.y / k, GL_RG8);
-    fboNeighborMax.allocate(sz.x / k, sz.y / k, GL_RG8);
-    fboTileMax.getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
-    fboNeighborMax.getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    if (backend != BACKEND_GL) return;
     
     // This is based on the paper "A Reconstruction Filter for Plausible Motion Blur"
     // http://graphics.cs.williams.edu/papers/MotionBlurI3D12/
@@ -29,11 +44,12 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
      uniform sampler2DRect tex;  // This is reference size texture
      uniform sampler2DRect texVelocity; // This is velocity texture
      uniform float k;
+     uniform vec2 viewport; // the last tiles end here
      void main() {
          int startx = int(gl_TexCoord[0].x) * int(k);
          int starty = int(gl_TexCoord[0].y) * int(k);
-         int endx = startx + int(k) - 1;
-         int endy = starty + int(k) - 1;
+         int endx = min(startx + int(k), int(viewport.x)) - 1;
+         int endy = min(starty + int(k), int(viewport.y)) - 1;
          float velocitymax = 0.0;
          vec2 velocitymaxvec = vec2(127.0/255.0);
          for (int y=starty; y<=endy; ++y) {
@@ -54,6 +70,7 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
     string neighborMaxFragShader = STRINGIFY
     (
      uniform sampler2DRect tex;
+     uniform vec2 tileCount; // the target is larger below the full resolution
      void main() {
          int u = int(gl_TexCoord[0].x);
          int v = int(gl_TexCoord[0].y);
@@ -61,7 +78,7 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
          vec2 velocitymaxvec = vec2(127.0/255.0);
          for (int y=v-1; y<=v+1; ++y) {
              for (int x=u-1; x<=u+1; ++x) {
-                 vec2 vvec = texture2DRect(tex, vec2(x,y)).xy;
+                 vec2 vvec = texture2DRect(tex, clamp(vec2(x,y), vec2(0.0), tileCount - vec2(1.0)) + vec2(0.5)).xy;
                  vec2 vvecdec = (vvec - vec2(127.0/255.0));
                  float v = length(vvecdec);
                  if (v > velocitymax) {
@@ -74,33 +91,58 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
      }
      );
     
-    string reconstructionFragShader = STRINGIFY
+    string velocitySrc = STRINGIFY
     (
-     uniform sampler2DRect tex;
-     uniform sampler2DRect texVelocity;
-     uniform sampler2DRect normalDepth;
      uniform sampler2DRect neighborMax;
      uniform float k;
-     uniform float farClip;
-     uniform int S;
      uniform vec2 viewport;
      uniform float exposureTime;
      uniform float fps;
      
-     const float SOFT_Z_EXTENT = 0.1;
-     
-     // convert to pixel space
+     // convert to pixel space, a quarter of the motion, (127/255)^2, is the
+     // blur length the exposure time was tuned for
      vec2 decodeVelocity(const in vec2 v) {
-         vec2 vd = v;
-         vd = (vd - vec2(127.0/255.0));
-         vd = (vd * vd) * sign(vd) * viewport;
+         vec2 vd = gbufferDecodeVelocity(v, viewport) * (127.0/255.0) * (127.0/255.0);
          
-         // clamp
-         float length = clamp(exposureTime * fps * length(vd), 0.0, k);
-         vd = normalize(vd) * length;
-         
-         return vd;
+         // clamp, zero has no direction
+         float len = length(vd);
+         if (len == 0.0) {
+             return vd;
+         }
+         return vd / len * clamp(exposureTime * fps * len, 0.0, k);
+     }
+     );
+    
+    // The reconstruction draws a quad per tile with its NeighborMax tile in the
+    // normal. Tiles moving less than half a pixel are only copied, so the
+    // reconstruction and the copy each collapse the tiles of the other kind.
+    string tileVertShader = STRINGIFY
+    (
+     uniform bool movingTiles;
+     void main() {
+         vec2 vmax = decodeVelocity(texelFetch2DRect(neighborMax, ivec2(gl_Normal.xy)).xy);
+         bool moving = length(vmax) >= 0.5;
+         gl_TexCoord[0] = gl_MultiTexCoord0;
+         gl_Position = moving == movingTiles ? gl_ModelViewProjectionMatrix * gl_Vertex : vec4(2.0, 2.0, 2.0, 1.0);
+     }
+     );
+    
+    string copyFragShader = STRINGIFY
+    (
+     uniform sampler2DRect tex;
+     void main() {
+         gl_FragColor = texture2DRect(tex, gl_TexCoord[0].xy);
      }
+     );
+    
+    string reconstructionFragShader = STRINGIFY
+    (
+     uniform sampler2DRect tex;
+     uniform sampler2DRect texVelocity;
+     uniform int S;
+     uniform vec2 tileCount;
+     
+     const float SOFT_Z_EXTENT = 0.1;
      
      float rand(vec2 co) {
          return fract(sin(dot(co.xy ,vec2(12.9898,78.233))) * 43758.5453);
@@ -120,27 +162,26 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
      
      void main() {
          vec2 uv = gl_TexCoord[0].xy;
-         int x = int(uv.x / k);
-         int y = int(uv.y / k);
-         vec2 vmax = decodeVelocity(texelFetch2DRect(neighborMax, ivec2(x,y)).xy);
-         if (length(vmax) < 0.5) {
-             gl_FragColor = texture2DRect(tex, uv);
-             return;
-         }
+         ivec2 tile = min(ivec2(uv / k), ivec2(tileCount) - ivec2(1));
+         vec2 vmax = decodeVelocity(texelFetch2DRect(neighborMax, tile).xy);
+         // about S taps over the longest span k, odd to keep the center one out
+         int tileS = int(clamp(ceil(float(S) * length(vmax) / k), 3.0, float(S)));
+         tileS = min(tileS / 2 * 2 + 1, S);
          vec2 v = decodeVelocity(texelFetch2DRect(texVelocity, ivec2(uv)).xy);
          float lv = clamp(length(v), 1.0, k);
          float weight = 1.0 / lv;
          vec4 sum = texture2DRect(tex, uv) * weight;
          float j = -0.5 + 1.0 * rand(uv);
          vec2 X = uv;
-         for (int i=0; i<S; ++i) {
-             if (i==((S-1)/2)) {
+         for (int i=0; i<tileS; ++i) {
+             if (i==((tileS-1)/2)) {
                  continue;
              }
-             float t = mix(-1.0, 1.0, (i + j + 1.0) / (S + 1.0));
-             vec2 Y = floor(uv + vmax * t + vec2(0.5));
-             float zx = farClip * texelFetch2DRect(normalDepth, ivec2(uv)).a;
-             float zy = farClip * texelFetch2DRect(normalDepth, ivec2(Y)).a;
+             float t = mix(-1.0, 1.0, (i + j + 1.0) / (tileS + 1.0));
+             // the texels past the viewport are left from larger frames
+             vec2 Y = clamp(floor(uv + vmax * t + vec2(0.5)), vec2(0.0), viewport - vec2(1.0));
+             float zx = u_cameraClip.y * gbufferLinearDepth(vec2(ivec2(uv)) + vec2(0.5));
+             float zy = u_cameraClip.y * gbufferLinearDepth(Y + vec2(0.5));
              vec2 vy = decodeVelocity(texelFetch2DRect(texVelocity, ivec2(Y)).xy);
              
              float f = softDepthCompare(zx, zy);
@@ -153,46 +194,365 @@ MotionBlurPass::MotionBlurPass(const ofVec2f& sz, float k) : RenderPass(sz, "Mot
      }
      );
     
-    createShaderWithHeader(tileMaxShader, tileMaxFragShader);
-    createShaderWithHeader(neighborMaxShader, neighborMaxFragShader);
-    createShaderWithHeader(reconstructionShader, reconstructionFragShader);
+    setupShader(tileMaxShader, sourcesWithHeader(tileMaxFragShader));
+    setupShader(neighborMaxShader, sourcesWithHeader(neighborMaxFragShader));
+    string velocitySrcWithGBuffer = GBuffer::getShaderSource() + velocitySrc;
+    setupShader(reconstructionShader, sourcesWithHeader(velocitySrcWithGBuffer + reconstructionFragShader, velocitySrcWithGBuffer + tileVertShader));
+    setupShader(copyShader, sourcesWithHeader(copyFragShader, velocitySrcWithGBuffer + tileVertShader));
+    setupTileMesh();
+    
+    // One work group per tile. Every invocation keeps the max of its strided
+    // share of the k x k texels, then the group halves the candidates in shared
+    // memory until one is left, so each velocity texel is fetched once.
+    string tileMaxComputeShaderSrc = STRINGIFY
+    (
+     uniform sampler2DRect texVelocity;
+     uniform int k;
+     uniform ivec2 viewport; // the last tiles end here
+     layout(rg8, binding = 0) uniform writeonly image2DRect tileMax;
+     
+     shared vec3 candidates[GROUP_SIZE * GROUP_SIZE]; // encoded velocity, decoded length
+     
+     void main() {
+         ivec2 tile = ivec2(gl_WorkGroupID.xy);
+         ivec2 start = tile * k;
+         ivec2 end = min(ivec2(k), viewport - start);
+         vec3 velocitymax = vec3(vec2(127.0/255.0), 0.0);
+         for (int y=int(gl_LocalInvocationID.y); y<end.y; y+=GROUP_SIZE) {
+             for (int x=int(gl_LocalInvocationID.x); x<end.x; x+=GROUP_SIZE) {
+                 vec2 vvec = texelFetch(texVelocity, start + ivec2(x, y)).xy;
+                 float v = length(vvec - vec2(127.0/255.0));
+                 if (v > velocitymax.z) {
+                     velocitymax = vec3(vvec, v);
+                 }
+             }
+         }
+         
+         uint index = gl_LocalInvocationIndex;
+         candidates[index] = velocitymax;
+         barrier();
+         for (uint stride=uint(GROUP_SIZE * GROUP_SIZE / 2); stride>0u; stride>>=1) {
+             if (index < stride && candidates[index + stride].z > candidates[index].z) {
+                 candidates[index] = candidates[index + stride];
+             }
+             barrier();
+         }
+         
+         if (index == 0u) {
+             imageStore(tileMax, tile, vec4(candidates[0].xy, 0.0, 1.0));
+         }
+     }
+     );
+    
+    // One invocation per tile. The group loads its tiles and a one tile border
+    // into shared memory once, the 3x3 max then reads from there.
+    string neighborMaxComputeShaderSrc = STRINGIFY
+    (
+     uniform sampler2DRect tileMax;
+     uniform ivec2 tileCount; // the target is larger below the full resolution
+     layout(rg8, binding = 0) uniform writeonly image2DRect neighborMax;
+     
+     const int BORDERED_SIZE = GROUP_SIZE + 2;
+     shared vec3 tiles[BORDERED_SIZE * BORDERED_SIZE]; // encoded velocity, decoded length
+     
+     void main() {
+         ivec2 size = tileCount;
+         ivec2 origin = ivec2(gl_WorkGroupID.xy) * GROUP_SIZE - ivec2(1);
+         for (int i=int(gl_LocalInvocationIndex); i<BORDERED_SIZE*BORDERED_SIZE; i+=GROUP_SIZE*GROUP_SIZE) {
+             ivec2 p = clamp(origin + ivec2(i % BORDERED_SIZE, i / BORDERED_SIZE), ivec2(0), size - ivec2(1));
+             vec2 vvec = texelFetch(tileMax, p).xy;
+             tiles[i] = vec3(vvec, length(vvec - vec2(127.0/255.0)));
+         }
+         barrier();
+         
+         ivec2 id = ivec2(gl_GlobalInvocationID.xy);
+         if (id.x >= size.x || id.y >= size.y) {
+             return;
+         }
+         ivec2 local = ivec2(gl_LocalInvocationID.xy);
+         vec3 velocitymax = vec3(vec2(127.0/255.0), 0.0);
+         for (int y=0; y<3; ++y) {
+             for (int x=0; x<3; ++x) {
+                 vec3 t = tiles[(local.y + y) * BORDERED_SIZE + local.x + x];
+                 if (t.z > velocitymax.z) {
+                     velocitymax = t;
+                 }
+             }
+         }
+         imageStore(neighborMax, id, vec4(velocitymax.xy, 0.0, 1.0));
+     }
+     );
+    
+    // #version 430 needs a GL 4.3 context, keep the fragment shaders otherwise
+    if (GLEW_VERSION_4_3) {
+        setupShader(tileMaxComputeShader, computeSources(tileMaxComputeShaderSrc));
+        setupShader(neighborMaxComputeShader, computeSources(neighborMaxComputeShaderSrc));
+        useCompute = true;
+        checkCompute = true;
+    }
+}
+
+// a quad per tile of the current size, the last row and column may be partial
+void MotionBlurPass::setupTileMesh() {
+    tilesX = getTileCount(size.x, k);
+    tilesY = getTileCount(size.y, k);
+    meshSize = size;
+    tileMesh.clear();
+    tileMesh.setMode(OF_PRIMITIVE_TRIANGLES);
+    for (int ty = 0; ty < tilesY; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            float x0 = tx * k;
+            float y0 = ty * k;
+            float x1 = min((tx + 1) * k, size.x);
+            float y1 = min((ty + 1) * k, size.y);
+            const ofVec2f corners[6] = {
+                ofVec2f(x0, y0), ofVec2f(x1, y0), ofVec2f(x1, y1),
+                ofVec2f(x0, y0), ofVec2f(x1, y1), ofVec2f(x0, y1)
+            };
+            for (const ofVec2f& c : corners) {
+                tileMesh.addVertex(ofVec3f(c.x, c.y, 0));
+                tileMesh.addTexCoord(c);
+                tileMesh.addNormal(ofVec3f(tx, ty, 0));
+            }
+        }
+    }
 }
 
 void MotionBlurPass::update(ofCamera& cam) {
-    farClip = cam.getFarClip();
+    farClip = getCameraData(cam).getFarClip();
 }
 
 void MotionBlurPass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer) {
-    // Tile Max
-    fboTileMax.begin();
-    tileMaxShader.begin();
-    tileMaxShader.setUniformTexture("texVelocity", gbuffer.getTexture(GBuffer::TYPE_VELOCITY), 1);
-    tileMaxShader.setUniform1f("k", k);
-    fboNeighborMax.getTextureReference().draw(0, 0);
-    tileMaxShader.end();
-    fboTileMax.end();
+    // the shaders are linked by the first render
+    if (checkCompute) {
+        checkCompute = false;
+        useCompute = ShaderCache::isLinked(tileMaxComputeShader) && ShaderCache::isLinked(neighborMaxComputeShader);
+        if (!useCompute) {
+            ofLogWarning("MotionBlurPass") << "compute shaders failed, using the fragment shader tile max";
+        }
+    }
     
-    // Neighbor Max
-    fboNeighborMax.begin();
-    neighborMaxShader.begin();
-    fboTileMax.draw(0, 0);
-    neighborMaxShader.end();
-    fboNeighborMax.end();
+    // size follows the resolution scale of the Processor, the targets stay at full size
+    if (meshSize != size) {
+        setupTileMesh();
+    }
+    ofFbo& fboTileMax = acquireTarget(getTileCount(fullSize.x, k), getTileCount(fullSize.y, k), GL_RG8);
+    ofFbo& fboNeighborMax = acquireTarget(getTileCount(fullSize.x, k), getTileCount(fullSize.y, k), GL_RG8);
+    fboTileMax.getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    fboNeighborMax.getTextureReference().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
+    
+    if (useCompute) {
+        // Tile Max
+        tileMaxComputeShader.begin();
+        tileMaxComputeShader.setUniformTexture("texVelocity", gbuffer.getTexture(GBuffer::TYPE_VELOCITY), 1);
+        tileMaxComputeShader.setUniform1i("k", k);
+        tileMaxComputeShader.setUniform2i("viewport", size.x, size.y);
+        glBindImageTexture(0, fboTileMax.getTextureReference().getTextureData().textureID, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG8);
+        tileMaxComputeShader.dispatchCompute(tilesX, tilesY, 1);
+        tileMaxComputeShader.end();
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        
+        // Neighbor Max
+        neighborMaxComputeShader.begin();
+        neighborMaxComputeShader.setUniformTexture("tileMax", fboTileMax.getTextureReference(), 1);
+        neighborMaxComputeShader.setUniform2i("tileCount", tilesX, tilesY);
+        glBindImageTexture(0, fboNeighborMax.getTextureReference().getTextureData().textureID, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG8);
+        neighborMaxComputeShader.dispatchCompute((tilesX + TILE_GROUP_SIZE - 1) / TILE_GROUP_SIZE, (tilesY + TILE_GROUP_SIZE - 1) / TILE_GROUP_SIZE, 1);
+        neighborMaxComputeShader.end();
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    } else {
+        // Tile Max
+        fboTileMax.begin();
+        tileMaxShader.begin();
+        tileMaxShader.setUniformTexture("texVelocity", gbuffer.getTexture(GBuffer::TYPE_VELOCITY), 1);
+        tileMaxShader.setUniform1f("k", k);
+        tileMaxShader.setUniform2f("viewport", size.x, size.y);
+        texturedQuad(0, 0, tilesX, tilesY, tilesX, tilesY);
+        tileMaxShader.end();
+        fboTileMax.end();
+        
+        // Neighbor Max
+        fboNeighborMax.begin();
+        neighborMaxShader.begin();
+        neighborMaxShader.setUniformTexture("tex", fboTileMax.getTextureReference(), 0);
+        neighborMaxShader.setUniform2f("tileCount", tilesX, tilesY);
+        texturedQuad(0, 0, tilesX, tilesY, tilesX, tilesY);
+        neighborMaxShader.end();
+        fboNeighborMax.end();
+    }
     
     writeFbo.begin();
     ofClear(0);
+    
+    copyShader.begin();
+    copyShader.setUniform1i("movingTiles", false);
+    copyShader.setUniform1f("k", k);
+    copyShader.setUniform1f("exposureTime", settings.exposureTime);
+    copyShader.setUniform1f("fps", getFrameRate());
+    copyShader.setUniform2f("viewport", size.x, size.y);
+    copyShader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    copyShader.setUniformTexture("neighborMax", fboNeighborMax.getTextureReference(), 3);
+    tileMesh.draw();
+    copyShader.end();
+    
     reconstructionShader.begin();
-    reconstructionShader.setUniform1f("farClip", farClip);
+    reconstructionShader.setUniform1i("movingTiles", true);
     reconstructionShader.setUniform1f("k", k);
     reconstructionShader.setUniform1i("S", settings.S);
     reconstructionShader.setUniform1f("exposureTime", settings.exposureTime);
-    reconstructionShader.setUniform1f("fps", ofGetFrameRate());
+    reconstructionShader.setUniform1f("fps", getFrameRate());
     reconstructionShader.setUniform2f("viewport", size.x, size.y);
+    reconstructionShader.setUniform2f("tileCount", tilesX, tilesY);
     reconstructionShader.setUniformTexture("texVelocity", gbuffer.getTexture(GBuffer::TYPE_VELOCITY), 1);
-    reconstructionShader.setUniformTexture("normalDepth", gbuffer.getTexture(GBuffer::TYPE_NORMAL_DEPTH), 2);
+    gbuffer.setShaderUniforms(reconstructionShader, 4);
+    reconstructionShader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
     reconstructionShader.setUniformTexture("neighborMax", fboNeighborMax.getTextureReference(), 3);
-    
-    readFbo.draw(0, 0);
+    tileMesh.draw();
     reconstructionShader.end();
     writeFbo.end();
-}
\ No newline at end of file
+    
+    releaseTarget(fboTileMax);
+    releaseTarget(fboNeighborMax);
+}
+
+static inline float fract(float x) {
+    return x - floor(x);
+}
+
+// renderCpu helpers, same as the functions of the reconstruction shader
+static const float VELOCITY_ZERO = 127.0 / 255.0;
+
+static inline float velocityLength(const float* v) {
+    return ofVec2f(v[0] - VELOCITY_ZERO, v[1] - VELOCITY_ZERO).length();
+}
+
+static inline ofVec2f decodeVelocity(const float* v, const ofVec2f& viewport, float exposureTime, float fps, float k) {
+    ofVec2f vd(v[0] - VELOCITY_ZERO, v[1] - VELOCITY_ZERO);
+    vd.x = vd.x * fabs(vd.x) * viewport.x;
+    vd.y = vd.y * fabs(vd.y) * viewport.y;
+    float len = vd.length();
+    if (len == 0) return vd;
+    return vd / len * ofClamp(exposureTime * fps * len, 0.0, k);
+}
+
+static inline float softDepthCompare(float za, float zb) {
+    return ofClamp(1.0 - (za - zb) / 0.1, 0.0, 1.0);
+}
+
+static inline float cone(float dist, float v) {
+    return v > 0 ? ofClamp(1.0 - dist / v, 0.0, 1.0) : 0.0;
+}
+
+static inline float cylinder(float dist, float v) {
+    float t = ofClamp((dist - 0.95 * v) / (0.1 * v), 0.0, 1.0);
+    return v > 0 ? 1.0 - t * t * (3.0 - 2.0 * t) : (dist > 0 ? 0.0 : 1.0);
+}
+
+// keeps the encoded vector with the longest decoded length
+static inline void maxVelocity(const float* v, float& maxLength, float* maxVec) {
+    float len = velocityLength(v);
+    if (len > maxLength) {
+        maxLength = len;
+        maxVec[0] = v[0];
+        maxVec[1] = v[1];
+    }
+}
+
+bool MotionBlurPass::renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool)
+{
+    const ofFloatPixels& velocity = gbuffer.getPixels(GBuffer::TYPE_VELOCITY);
+    const ofFloatPixels& normalDepth = gbuffer.getPixels(GBuffer::TYPE_NORMAL_DEPTH);
+    int w = readPixels.getWidth();
+    int h = readPixels.getHeight();
+    int ik = k;
+    int tilesX = getTileCount(w, k);
+    int tilesY = getTileCount(h, k);
+    if (!cpuTileMax.isAllocated() || cpuTileMax.getWidth() != tilesX || cpuTileMax.getHeight() != tilesY) {
+        cpuTileMax.allocate(tilesX, tilesY, 4);
+        cpuNeighborMax.allocate(tilesX, tilesY, 4);
+    }
+    
+    // Tile Max
+    pool.parallelFor(0, tilesY, [&](int ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            float maxLength = 0.0;
+            float* maxVec = cpuTileMax.getData() + (ty * tilesX + tx) * 4;
+            maxVec[0] = maxVec[1] = VELOCITY_ZERO;
+            for (int y = ty * ik; y < min((ty + 1) * ik, h); ++y) {
+                for (int x = tx * ik; x < min((tx + 1) * ik, w); ++x) {
+                    maxVelocity(fetchPixel(velocity, x, y), maxLength, maxVec);
+                }
+            }
+        }
+    });
+    
+    // Neighbor Max
+    pool.parallelFor(0, tilesY, [&](int ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            float maxLength = 0.0;
+            float* maxVec = cpuNeighborMax.getData() + (ty * tilesX + tx) * 4;
+            maxVec[0] = maxVec[1] = VELOCITY_ZERO;
+            for (int y = ty - 1; y <= ty + 1; ++y) {
+                for (int x = tx - 1; x <= tx + 1; ++x) {
+                    maxVelocity(fetchPixel(cpuTileMax, x, y), maxLength, maxVec);
+                }
+            }
+        }
+    });
+    
+    // Reconstruction
+    ofVec2f viewport(size.x, size.y);
+    float fps = getFrameRate();
+    int S = settings.S;
+    pool.parallelForTiles(w, h, 32, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            float* out = writePixels.getData() + (y * w + x0) * 4;
+            for (int x = x0; x < x1; ++x, out += 4) {
+                ofVec2f uv(x + 0.5f, y + 0.5f);
+                ofVec2f vmax = decodeVelocity(fetchPixel(cpuNeighborMax, uv.x / k, uv.y / k), viewport, settings.exposureTime, fps, k);
+                if (vmax.length() < 0.5) {
+                    const float* src = fetchPixel(readPixels, x, y);
+                    copy(src, src + 4, out);
+                    continue;
+                }
+                int tileS = ofClamp(ceil(S * vmax.length() / k), 3, S);
+                tileS = min(tileS / 2 * 2 + 1, S);
+                ofVec2f v = decodeVelocity(fetchPixel(velocity, x, y), viewport, settings.exposureTime, fps, k);
+                float lv = ofClamp(v.length(), 1.0, k);
+                float weight = 1.0 / lv;
+                float sum[4];
+                const float* src = fetchPixel(readPixels, x, y);
+                for (int c = 0; c < 4; ++c) {
+                    sum[c] = src[c] * weight;
+                }
+                float j = -0.5 + fract(sin(uv.x * 12.9898f + uv.y * 78.233f) * 43758.5453f);
+                float zx = farClip * fetchPixel(normalDepth, x, y)[3];
+                for (int i = 0; i < tileS; ++i) {
+                    if (i == (tileS - 1) / 2) {
+                        continue;
+                    }
+                    float t = ofLerp(-1.0, 1.0, (i + j + 1.0) / (tileS + 1.0));
+                    ofVec2f Y(floor(uv.x + vmax.x * t + 0.5f), floor(uv.y + vmax.y * t + 0.5f));
+                    float zy = farClip * fetchPixel(normalDepth, Y.x, Y.y)[3];
+                    ofVec2f vy = decodeVelocity(fetchPixel(velocity, Y.x, Y.y), viewport, settings.exposureTime, fps, k);
+                    
+                    float dist = uv.distance(Y);
+                    float f = softDepthCompare(zx, zy);
+                    float b = softDepthCompare(zy, zx);
+                    float ay = b * cone(dist, vy.length()) + f * cone(dist, v.length())
+                        + cylinder(dist, vy.length()) * cylinder(dist, v.length()) * 2.0;
+                    weight += ay;
+                    float tap[4];
+                    samplePixel(readPixels, Y.x, Y.y, tap);
+                    for (int c = 0; c < 4; ++c) {
+                        sum[c] += tap[c] * ay;
+                    }
+                }
+                for (int c = 0; c < 4; ++c) {
+                    out[c] = sum[c] / weight;
+                }
+            }
+        }
+    });
+    return true;
+}
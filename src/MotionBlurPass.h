@@ -20,15 +20,30 @@ namespace DeferredEffect {
         
     private:
         float k;
-        
-        ofFbo fboTileMax;
-        ofFbo fboNeighborMax;
+        // the TileMax and NeighborMax targets are acquired per render,
+        // the tiles of the current size are drawn to their lower left
+        int tilesX, tilesY;
+        ofVec2f meshSize;
         
         ofShader tileMaxShader;
         ofShader neighborMaxShader;
         ofShader reconstructionShader;
+        ofShader copyShader;
+        ofVboMesh tileMesh;
+        
+        // GL 4.3 : TileMax and NeighborMax as compute shaders, reduced in shared memory
+        bool useCompute;
+        bool checkCompute;
+        ofShader tileMaxComputeShader;
+        ofShader neighborMaxComputeShader;
         
         float farClip;
+        
+        void setupTileMesh();
+        
+        // encoded tile velocities for renderCpu
+        ofFloatPixels cpuTileMax;
+        ofFloatPixels cpuNeighborMax;
     public:
         typedef shared_ptr<MotionBlurPass> Ptr;
         
@@ -36,5 +51,10 @@ namespace DeferredEffect {
         
         void update(ofCamera& cam);
         void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool);
+        
+        // false when the fragment shader fallback computes the velocity tiles,
+        // final once the pass isReady()
+        bool isUsingComputeShader() const { return useCompute; }
     };
 }
@@ -1,10 +1,59 @@
 #include "Processor.h"
+#define STRINGIFY(A) #A
 
 using namespace DeferredEffect;
 
+Backend RenderPass::creationBackend = BACKEND_GL;
+
+// length of the jitter sequence, repeats after that many frames
+static const int JITTER_SAMPLES = 8;
+
+// radical inverse of index in base, in [0, 1)
+static inline float halton(int index, int base) {
+    float result = 0;
+    float f = 1;
+    while (index > 0) {
+        f /= base;
+        result += f * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+// the names of the i-th pass of a point-wise shader start with this
+static string getPointwisePrefix(int i) {
+    return "pass" + ofToString(i) + "_";
+}
+
+// a fragment shader applying the point-wise passes to tex one after another
+static string getPointwiseShaderSource(const vector<const RenderPass*>& passes) {
+    stringstream src;
+    src << GBuffer::getShaderHeader();
+    src << GBuffer::getShaderSource();
+    src << "uniform sampler2DRect tex;" << endl;
+    for (int i = 0; i < passes.size(); ++i) {
+        string passSrc = passes[i]->getPointwiseSource();
+        ofStringReplace(passSrc, "PASS_", getPointwisePrefix(i));
+        src << passSrc << endl;
+    }
+    src << "void main() {" << endl;
+    src << "    vec2 texCoord = gl_TexCoord[0].xy;" << endl;
+    src << "    vec4 color = texture2DRect(tex, texCoord);" << endl;
+    for (int i = 0; i < passes.size(); ++i) {
+        src << "    color = " << getPointwisePrefix(i) << "apply(color, texCoord);" << endl;
+    }
+    src << "    gl_FragColor = color;" << endl;
+    src << "}" << endl;
+    return src.str();
+}
+
 void RenderPass::texturedQuad(float x, float y, float width, float height, float s, float t)
 {
-    // TODO: change to triangle fan/strip
+    if (CoreProfile::isEnabled()) {
+        CoreProfile::drawQuad(x, y, width, height, s, t);
+        return;
+    }
+    
     glBegin(GL_QUADS);
     glTexCoord2f(0, 0);
     glVertex3f(x, y, 0);
@@ -20,17 +69,90 @@ void RenderPass::texturedQuad(float x, float y, float width, float height, float
     glEnd();
 }
 
-void Processor::init(unsigned width, unsigned height)
+ShaderCache::Sources RenderPass::getPointwiseSources() const
+{
+    ShaderCache::Sources sources;
+    sources[GL_FRAGMENT_SHADER] = getPointwiseShaderSource(vector<const RenderPass*>(1, this));
+    return sources;
+}
+
+void RenderPass::renderPointwise(ofShader& shader, ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    writeFbo.begin();
+    shader.begin();
+    shader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    gbuffer.setShaderUniforms(shader, 1);
+    setPointwiseUniforms(shader, getPointwisePrefix(0), 3);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    shader.end();
+    writeFbo.end();
+}
+
+bool RenderPass::isReady()
+{
+    for (auto it = shaderJobs.begin(); it != shaderJobs.end();) {
+        if (ShaderCache::poll(*it)) it = shaderJobs.erase(it);
+        else ++it;
+    }
+    return shaderJobs.empty();
+}
+
+void RenderPass::setupShader(ofShader& shader, const ShaderCache::Sources& sources)
+{
+    ShaderCache::Job job;
+    if (ShaderCache::setupAsync(shader, sources, job)) {
+        shaderJobs.push_back(job);
+    }
+}
+
+ofFbo& RenderPass::acquireTarget(int width, int height, int internalFormat)
+{
+    if (!targetPool) {
+        ownTargetPool = shared_ptr<RenderTargetPool>(new RenderTargetPool());
+        targetPool = ownTargetPool.get();
+    }
+    return targetPool->acquire(width, height, internalFormat);
+}
+
+void RenderPass::releaseTarget(ofFbo& fbo)
+{
+    if (targetPool) targetPool->release(fbo);
+}
+
+const CameraData& RenderPass::getCameraData(ofCamera& cam)
+{
+    if (cameraData) return *cameraData;
+    if (!ownCameraData) {
+        ownCameraData = shared_ptr<CameraData>(new CameraData());
+    }
+    ownCameraData->update(cam, ofRectangle(0, 0, size.x, size.y));
+    return *ownCameraData;
+}
+
+void Processor::init(unsigned width, unsigned height, Backend backend)
 {
     this->width = width;
     this->height = height;
+    this->backend = backend;
     
+    numProcessedPasses = 0;
+    currentReadFbo = 0;
     
-    // no need to use depth for ping pongs
-    for (int i = 0; i < 2; ++i)
-    {
-        pingPong[i].allocate(width, height, GL_RGBA);
+    if (backend == BACKEND_CPU) {
+        cpuRaw.allocate(width, height, 4);
+        cpuRaw.set(0);
+        for (int i = 0; i < 2; ++i) {
+            cpuPingPong[i].allocate(width, height, 4);
+        }
+        cpuGbuffer.setup(width, height);
+        pool.setup();
+        return;
     }
+    pool.stop();
+    
+    pingPong[0] = pingPong[1] = NULL;
+    upscaled = NULL;
+    targetPool.clear();
     
     ofFbo::Settings s;
     s.width = width;
@@ -41,17 +163,114 @@ void Processor::init(unsigned width, unsigned height)
     s.depthStencilAsTexture = true;
     raw.allocate(s);
     
-    numProcessedPasses = 0;
-    currentReadFbo = 0;
-    
     gbuffer.setup(width, height);
+    
+    // Catmull-Rom from the lower left renderSize of tex to the full target, 16 taps
+    // clamped to the rendered area, the lobes keep the edges from going soft
+    string upscaleFragShader = STRINGIFY
+    (
+     uniform sampler2DRect tex;
+     uniform vec2 u_scale; // render size / full size
+     uniform vec2 u_renderSize;
+     
+     vec4 weights(float t)
+     {
+         float t2 = t * t;
+         float t3 = t2 * t;
+         return vec4(-0.5 * t3 + t2 - 0.5 * t,
+                     1.5 * t3 - 2.5 * t2 + 1.0,
+                     -1.5 * t3 + 2.0 * t2 + 0.5 * t,
+                     0.5 * t3 - 0.5 * t2);
+     }
+     
+     void main() {
+         vec2 p = gl_TexCoord[0].xy * u_scale - vec2(0.5);
+         vec2 base = floor(p);
+         vec4 wx = weights(p.x - base.x);
+         vec4 wy = weights(p.y - base.y);
+         vec4 sum = vec4(0.0);
+         for (int y = 0; y < 4; ++y) {
+             for (int x = 0; x < 4; ++x) {
+                 vec2 coord = clamp(base + vec2(float(x) - 0.5, float(y) - 0.5), vec2(0.5), u_renderSize - vec2(0.5));
+                 sum += texture2DRect(tex, coord) * wx[x] * wy[y];
+             }
+         }
+         gl_FragColor = sum;
+     }
+     );
+    ShaderCache::Sources sources;
+    sources[GL_FRAGMENT_SHADER] = "#version 120\n" + upscaleFragShader;
+    upscalePending = ShaderCache::setupAsync(upscaleShader, sources, upscaleJob);
+}
+
+bool Processor::isReady()
+{
+    bool ready = true;
+    for (auto& pass : passes) {
+        ready = pass->isReady() && ready;
+    }
+    return ready;
+}
+
+// once per frame, beginGbuffer() usually comes first
+void Processor::updateCamera(ofCamera& cam)
+{
+    if (cameraData.getFrameNum() == ofGetFrameNum()) return;
+    updateResolution();
+    if (jitterEnabled && backend == BACKEND_GL) {
+        // index 0 would be the pixel corner
+        int index = ofGetFrameNum() % JITTER_SAMPLES + 1;
+        cameraData.setJitter(ofVec2f(halton(index, 2) - 0.5f, halton(index, 3) - 0.5f));
+    } else {
+        cameraData.setJitter(ofVec2f());
+    }
+    cameraData.update(cam, ofRectangle(0, 0, renderSize.x, renderSize.y));
+}
+
+void Processor::setDynamicResolutionEnabled(bool enabled)
+{
+    dynamicResolution = enabled;
+    frameScales.clear();
+    lastControlledFrame = numeric_limits<uint64_t>::max();
+    if (enabled) {
+        setProfilingEnabled(true);
+        resolutionController.reset();
+        resolutionScale = resolutionController.getScale();
+    } else {
+        resolutionScale = 1;
+    }
+}
+
+// The gpu time of a frame comes back a few frames later, the scale it was
+// rendered at is kept until then.
+void Processor::updateResolution()
+{
+    if (dynamicResolution) {
+        uint64_t measured = profiler.getLastGpuFrameNum();
+        while (!frameScales.empty() && frameScales.front().first < measured) {
+            frameScales.pop_front();
+        }
+        if (!frameScales.empty() && frameScales.front().first == measured && measured != lastControlledFrame) {
+            resolutionScale = resolutionController.update(profiler.getLastFrameGpuTime(), frameScales.front().second);
+            lastControlledFrame = measured;
+        }
+        frameScales.push_back(make_pair(ofGetFrameNum(), resolutionScale));
+        // without timer queries nothing is ever measured
+        while (frameScales.size() > 16) {
+            frameScales.pop_front();
+        }
+    }
+    
+    float scale = backend == BACKEND_GL ? resolutionScale : 1.f;
+    renderSize = ofVec2f(max(1.f, roundf(width * scale)), max(1.f, roundf(height * scale)));
+    for (auto& pass : passes) {
+        pass->size = renderSize;
+    }
 }
 
 void Processor::begin(ofCamera& cam)
 {
-    // update camera matrices
-    cam.begin();
-    cam.end();
+    updateCamera(cam);
     
     for (int i = 0; i < passes.size(); ++i) {
         if (passes[i]->getEnabled()) {
@@ -59,45 +278,77 @@ void Processor::begin(ofCamera& cam)
         }
     }
     
+    if (backend == BACKEND_CPU || inputSource != INPUT_RAW) return;
+    
+    profiler.begin("Raw");
     raw.begin();
     
     ofPushView();
     
-    ofRectangle viewport(0, 0, raw.getWidth(), raw.getHeight());
-    ofViewport(viewport);
-    ofSetOrientation(ofGetOrientation(),cam.isVFlipped());
+    // from the first row of the fbo, as the passes read it
+    const ofRectangle& viewport = cameraData.getViewport();
+    ofViewport(viewport.x, viewport.y, viewport.width, viewport.height, false);
+    ofSetOrientation(ofGetOrientation(), cameraData.isVFlipped());
     ofSetMatrixMode(OF_MATRIX_PROJECTION);
-    ofLoadMatrix(cam.getProjectionMatrix(viewport));
+    ofLoadMatrix(cameraData.getProjectionMatrix());
     ofSetMatrixMode(OF_MATRIX_MODELVIEW);
-    ofLoadMatrix(cam.getModelViewMatrix());
+    ofLoadMatrix(cameraData.getModelViewMatrix());
     
     ofPushStyle();
-    glPushAttrib(GL_ENABLE_BIT);
+    if (!CoreProfile::isEnabled()) glPushAttrib(GL_ENABLE_BIT);
 }
 
 void Processor::end(bool autoDraw)
 {
-    glPopAttrib();
-    ofPopStyle();
-    ofPopView();
+    if (backend == BACKEND_CPU) {
+        process(cpuRaw);
+        if (autoDraw) draw();
+        return;
+    }
     
-    raw.end();
+    if (inputSource == INPUT_RAW) {
+        if (!CoreProfile::isEnabled()) glPopAttrib();
+        ofPopStyle();
+        ofPopView();
+        
+        raw.end();
+        profiler.end();
+    }
     
+    // no attribute stack or fixed function lighting in the core profile
+    bool legacy = !CoreProfile::isEnabled();
     ofPushStyle();
-    glPushAttrib(GL_ENABLE_BIT);
-    glDisable(GL_LIGHTING);
+    if (legacy) {
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_LIGHTING);
+    }
     ofSetColor(255, 255, 255);
     process();
+    if (readbackEnabled) {
+        profiler.begin("Readback");
+        readback.readback(getProcessedTextureReference());
+        profiler.end();
+    }
     if (autoDraw) draw();
-    glPopAttrib();
+    if (legacy) glPopAttrib();
     ofPopStyle();
 }
 
 void Processor::debugDraw()
 {
-    raw.getTextureReference().draw(10, 10, 300, 300);
-    raw.getDepthTexture().draw(320, 10, 300, 300);
-    pingPong[currentReadFbo].draw(630, 10, 300, 300);
+    if (backend == BACKEND_CPU) {
+        updateCpuTexture();
+        cpuTexture.draw(10, 10, 300, 300);
+        return;
+    }
+    if (inputTexture) inputTexture->draw(10, 10, 300, 300);
+    if (inputSource == INPUT_RAW) raw.getDepthTexture().draw(320, 10, 300, 300);
+    else gbuffer.getFbo().getDepthTexture().draw(320, 10, 300, 300);
+    if (numProcessedPasses) pingPong[currentReadFbo]->draw(630, 10, 300, 300);
+    ofDrawBitmapString("pooled targets : " + ofToString(targetPool.getNumTargets()) + ", " +
+                       ofToString(targetPool.getMemoryUsage() / (1024.f * 1024.f), 1) + " MB", 10, 330);
+    ofDrawBitmapString("resolution : " + ofToString(renderSize.x) + "x" + ofToString(renderSize.y) +
+                       " (" + ofToString(resolutionScale * 100, 0) + "%)", 10, 345);
 }
 
 void Processor::draw(float x, float y) const
@@ -107,33 +358,245 @@ void Processor::draw(float x, float y) const
 
 void Processor::draw(float x, float y, float w, float h) const
 {
-    if (numProcessedPasses == 0) raw.draw(0, 0, w, h);
-    else pingPong[currentReadFbo].draw(0, 0, w, h);
+    if (backend == BACKEND_CPU) {
+        updateCpuTexture();
+        cpuTexture.draw(0, 0, w, h);
+        return;
+    }
+    if (upscaled) upscaled->draw(0, 0, w, h);
+    else if (numProcessedPasses) pingPong[currentReadFbo]->draw(0, 0, w, h);
+    else if (inputTexture) inputTexture->draw(0, 0, w, h);
 }
 
 ofTexture& Processor::getProcessedTextureReference()
 {
-    if (numProcessedPasses) return pingPong[currentReadFbo].getTextureReference();
+    if (backend == BACKEND_CPU) {
+        updateCpuTexture();
+        return cpuTexture;
+    }
+    if (upscaled) return upscaled->getTextureReference();
+    else if (numProcessedPasses) return pingPong[currentReadFbo]->getTextureReference();
+    else if (inputTexture) return *inputTexture;
     else return raw.getTextureReference();
 }
 
 // need to have depth enabled for some fx
 void Processor::process(ofFbo& raw)
 {
+    // the last result was kept for drawing until now
+    releasePingPong(0);
+    releasePingPong(1);
+    if (upscaled) {
+        targetPool.release(*upscaled);
+        upscaled = NULL;
+    }
+    inputTexture = &raw.getTextureReference();
     numProcessedPasses = 0;
     for (int i = 0; i < passes.size(); ++i)
     {
-        if (passes[i]->getEnabled())
+        // passes still compiling their shaders are skipped rather than waited for
+        if (passes[i]->getEnabled() && passes[i]->isReady())
         {
-            if (numProcessedPasses == 0) passes[i]->render(raw, pingPong[1 - currentReadFbo], gbuffer);
-            else passes[i]->render(pingPong[currentReadFbo], pingPong[1 - currentReadFbo], gbuffer);
+            if (fusionEnabled && passes[i]->isPointwise()) {
+                vector<RenderPass::Ptr> fused;
+                int last = i;
+                for (int j = i; j < passes.size(); ++j) {
+                    if (!passes[j]->getEnabled() || !passes[j]->isReady()) continue;
+                    if (!passes[j]->isPointwise()) break;
+                    fused.push_back(passes[j]);
+                    last = j;
+                }
+                ofShader* shader = fused.size() > 1 ? getFusedShader(fused) : NULL;
+                if (shader) {
+                    ofFbo& readFbo = numProcessedPasses == 0 ? raw : *pingPong[currentReadFbo];
+                    renderFused(fused, *shader, readFbo, acquirePingPong(1 - currentReadFbo));
+                    currentReadFbo = 1 - currentReadFbo;
+                    numProcessedPasses += fused.size();
+                    i = last;
+                    continue;
+                }
+            }
+            
+            profiler.begin(passes[i]->getName());
+            ofFbo& readFbo = numProcessedPasses == 0 ? raw : *pingPong[currentReadFbo];
+            passes[i]->render(readFbo, acquirePingPong(1 - currentReadFbo), gbuffer);
+            profiler.end();
             currentReadFbo = 1 - currentReadFbo;
             numProcessedPasses++;
         }
     }
+    // only the result stays in use
+    releasePingPong(1 - currentReadFbo);
+    if (renderSize.x != width || renderSize.y != height) {
+        upscale(numProcessedPasses ? pingPong[currentReadFbo]->getTextureReference() : *inputTexture);
+    }
+    targetPool.endFrame();
+}
+
+void Processor::upscale(ofTexture& texture)
+{
+    profiler.begin("Upscale");
+    upscaled = &targetPool.acquire(width, height, GL_RGBA);
+    upscaled->begin();
+    if (upscalePending && ShaderCache::poll(upscaleJob)) {
+        upscalePending = false;
+    }
+    if (!upscalePending && ShaderCache::isLinked(upscaleShader)) {
+        upscaleShader.begin();
+        upscaleShader.setUniformTexture("tex", texture, 0);
+        upscaleShader.setUniform2f("u_scale", renderSize.x / width, renderSize.y / height);
+        upscaleShader.setUniform2f("u_renderSize", renderSize.x, renderSize.y);
+        texture.draw(0, 0, width, height);
+        upscaleShader.end();
+    } else {
+        // bilinear until the shader is linked
+        texture.drawSubsection(0, 0, width, height, 0, 0, renderSize.x, renderSize.y);
+    }
+    upscaled->end();
+    profiler.end();
+}
+
+void Processor::beginOffline(const string& directory, float fps, FrameEncoder::Format format)
+{
+    if (backend != BACKEND_GL) return;
+    endOffline();
+    offlineFrameRate = fps;
+    for (auto& pass : passes) {
+        pass->setFrameRate(fps);
+    }
+    encoder.setup(directory, format);
+    readback.setFormat(GL_RGBA, encoder.getReadbackType());
+    readback.setWaitWhenFull(true);
+    readback.setCallback([this](const FrameReadback::Frame& frame) { encoder.add(frame); });
+    setReadbackEnabled(true);
+}
+
+void Processor::endOffline()
+{
+    if (!isOffline()) return;
+    readback.flush();
+    encoder.wait();
+    setReadbackEnabled(false);
+    readback.setCallback(nullptr);
+    readback.setWaitWhenFull(false);
+    offlineFrameRate = 0;
+    for (auto& pass : passes) {
+        pass->setFrameRate(0);
+    }
+}
+
+// no need to use depth for ping pongs
+ofFbo& Processor::acquirePingPong(unsigned i)
+{
+    if (!pingPong[i]) pingPong[i] = &targetPool.acquire(width, height, GL_RGBA);
+    return *pingPong[i];
+}
+
+void Processor::releasePingPong(unsigned i)
+{
+    if (!pingPong[i]) return;
+    targetPool.release(*pingPong[i]);
+    pingPong[i] = NULL;
+}
+
+// the fused shader is compiled in the background, until then the passes render one by one
+ofShader* Processor::getFusedShader(const vector<RenderPass::Ptr>& fused)
+{
+    vector<const RenderPass*> passes;
+    for (auto& pass : fused) {
+        passes.push_back(pass.get());
+    }
+    string key = getPointwiseShaderSource(passes);
+    
+    if (!fusedShaders.count(key)) {
+        ShaderCache::Sources sources;
+        sources[GL_FRAGMENT_SHADER] = key;
+        ShaderCache::Job job;
+        if (ShaderCache::setupAsync(fusedShaders[key], sources, job)) {
+            pendingFusedShaders[key] = job;
+        }
+    }
+    auto pending = pendingFusedShaders.find(key);
+    if (pending != pendingFusedShaders.end()) {
+        if (!ShaderCache::poll(pending->second)) return NULL;
+        pendingFusedShaders.erase(pending);
+    }
+    ofShader& shader = fusedShaders[key];
+    return ShaderCache::isLinked(shader) ? &shader : NULL;
+}
+
+void Processor::renderFused(const vector<RenderPass::Ptr>& fused, ofShader& shader, ofFbo& readFbo, ofFbo& writeFbo)
+{
+    string name;
+    for (auto& pass : fused) {
+        name += (name.empty() ? "" : "+") + pass->getName();
+    }
+    profiler.begin(name);
+    
+    writeFbo.begin();
+    shader.begin();
+    shader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    gbuffer.setShaderUniforms(shader, 1);
+    int textureUnit = 3;
+    for (int i = 0; i < fused.size(); ++i) {
+        textureUnit += fused[i]->setPointwiseUniforms(shader, getPointwisePrefix(i), textureUnit);
+    }
+    // only the rendered area, the rest of the targets is left from larger frames
+    readFbo.getTextureReference().drawSubsection(0, 0, renderSize.x, renderSize.y, 0, 0, renderSize.x, renderSize.y);
+    shader.end();
+    writeFbo.end();
+    
+    profiler.end();
 }
 
 void Processor::process()
 {
-    process(raw);
+    if (inputSource == INPUT_RAW) {
+        process(raw);
+        return;
+    }
+    // the passes read and draw the default texture of readFbo
+    ofFbo& fbo = gbuffer.getFbo();
+    fbo.setDefaultTextureIndex(inputSource == INPUT_ALBEDO ? GBuffer::TYPE_ALBEDO : GBuffer::TYPE_LIGHT_PASS);
+    process(fbo);
+    fbo.setDefaultTextureIndex(0);
+}
+
+void Processor::process(const ofFloatPixels& raw)
+{
+    numProcessedPasses = 0;
+    for (int i = 0; i < passes.size(); ++i)
+    {
+        if (passes[i]->getEnabled())
+        {
+            const ofFloatPixels& readPixels = numProcessedPasses == 0 ? raw : cpuPingPong[currentReadFbo];
+            profiler.begin(passes[i]->getName());
+            bool processed = passes[i]->renderCpu(readPixels, cpuPingPong[1 - currentReadFbo], cpuGbuffer, pool);
+            profiler.end();
+            if (processed) {
+                currentReadFbo = 1 - currentReadFbo;
+                numProcessedPasses++;
+            }
+        }
+    }
+    if (numProcessedPasses == 0) {
+        cpuPingPong[currentReadFbo] = raw;
+    }
+    cpuTextureDirty = true;
+}
+
+const ofFloatPixels& Processor::getProcessedPixelsRef() const
+{
+    return cpuPingPong[currentReadFbo];
+}
+
+void Processor::updateCpuTexture() const
+{
+    if (!cpuTextureDirty && cpuTexture.isAllocated()) return;
+    const ofFloatPixels& pixels = getProcessedPixelsRef();
+    if (!cpuTexture.isAllocated() || cpuTexture.getWidth() != width || cpuTexture.getHeight() != height) {
+        cpuTexture.allocate(width, height, GL_RGBA32F_ARB);
+    }
+    cpuTexture.loadData(pixels);
+    cpuTextureDirty = false;
 }
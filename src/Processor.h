@@ -1,20 +1,61 @@
 #pragma once
 #include "ofMain.h"
 #include "GBuffer.h"
+#include "CameraData.h"
+#include "CpuGBuffer.h"
+#include "Profiler.h"
+#include "RenderTargetPool.h"
+#include "FrameReadback.h"
+#include "FrameEncoder.h"
+#include "ShaderCache.h"
+#include "CoreProfile.h"
+#include "ThreadPool.h"
+#include "ResolutionController.h"
 
 // This code is modified from Neil Mendoza's ofxPostProcessing (BSD lisence)
 // https://github.com/neilmendoza/ofxPostProcessing
 namespace DeferredEffect {
 //    using namespace tr1;
     
+    enum Backend {
+        BACKEND_GL,
+        BACKEND_CPU // no GL calls at all, passes run renderCpu() on a thread pool
+    };
+    
     class RenderPass {
     public:
         typedef shared_ptr<RenderPass> Ptr;
         
-        RenderPass(const ofVec2f& sz, const string& n) : size(sz), name(n), enabled(true) {}
+        RenderPass(const ofVec2f& sz, const string& n) : name(n), enabled(true), size(sz), fullSize(sz), backend(creationBackend), frameRate(0), targetPool(NULL), cameraData(NULL) {}
+        virtual ~RenderPass() {}
         
         virtual void update(ofCamera& cam) = 0;
         virtual void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer) = 0;
+        // returns false if the pass has no cpu implementation, it is skipped then
+        virtual bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool) { return false; }
+        
+        // Point-wise passes only read their own pixel of readFbo (and the g buffer).
+        // Processor draws adjacent ones with one generated shader instead of
+        // render(), which they still need for when they can't be fused.
+        virtual bool isPointwise() const { return false; }
+        // GLSL defining vec4 PASS_apply(vec4 color, vec2 texCoord). Every global
+        // name starts with PASS_, which is replaced by a prefix unique in the
+        // fused shader. The GBuffer::getShaderSource() functions can be used.
+        virtual string getPointwiseSource() const { return ""; }
+        // sets the uniforms of getPointwiseSource() with the PASS_ prefix replaced
+        // by prefix, textures from textureUnit on. Returns the number of units used
+        virtual int setPointwiseUniforms(ofShader& shader, const string& prefix, int textureUnit) { return 0; }
+        
+        Backend getBackend() const { return backend; }
+        
+        // false while shaders from setupShader() are still compiling,
+        // Processor skips the pass until then
+        bool isReady();
+        
+        // what time dependent passes assume, ofGetFrameRate() unless a fixed rate
+        // is set, 0 goes back to it. Processor::beginOffline() sets it for all passes
+        void setFrameRate(float frameRate) { this->frameRate = frameRate; }
+        float getFrameRate() const { return frameRate > 0 ? frameRate : ofGetFrameRate(); }
         
         void setEnabled(bool enabled) { this->enabled = enabled; }
         bool getEnabled() const { return enabled; }
@@ -25,28 +66,88 @@ namespace DeferredEffect {
         
     protected:
         void texturedQuad(float x, float y, float width, float height, float s = 1.0, float t = 1.0);
+        // for render() of point-wise passes, getPointwiseSource() as a shader of its own
+        // and a draw of it set up from them
+        ShaderCache::Sources getPointwiseSources() const;
+        void renderPointwise(ofShader& shader, ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        // compiles in the background where possible, see ShaderCache::setupAsync()
+        void setupShader(ofShader& shader, const ShaderCache::Sources& sources);
+        // transient fbos from the Processor's pool, release them at the end of
+        // render() so later passes of the frame can reuse the memory
+        ofFbo& acquireTarget(int width, int height, int internalFormat);
+        void releaseTarget(ofFbo& fbo);
+        // for update(), the Processor's camera of this frame. Passes created
+        // otherwise compute their own from cam.
+        const CameraData& getCameraData(ofCamera& cam);
         
         string name;
         bool enabled;
+        // the area rendered this frame, from the origin of the targets. Below
+        // fullSize, the size the pass was created with, at a resolution scale
+        // of the Processor. Allocate for fullSize to keep the targets.
         ofVec2f size;
+        ofVec2f fullSize;
+        // passes don't touch GL when created for BACKEND_CPU
+        Backend backend;
+        float frameRate;
+        
+    private:
+        friend class Processor;
+        // Note : This is thread unsafe, set by Processor::createPass() around the constructor.
+        static Backend creationBackend;
+        vector<ShaderCache::Job> shaderJobs;
+        // set by Processor::createPass(), passes created otherwise use their own
+        RenderTargetPool* targetPool;
+        shared_ptr<RenderTargetPool> ownTargetPool;
+        CameraData* cameraData;
+        shared_ptr<CameraData> ownCameraData;
     };
     
     class Processor : public ofBaseDraws {
     public:
         typedef shared_ptr<Processor> Ptr;
         
-        void init(unsigned width = ofGetWidth(), unsigned height = ofGetHeight());
+        // what the pass chain starts from
+        enum InputSource {
+            INPUT_RAW,        // the scene drawn between begin() and end()
+            INPUT_ALBEDO,     // GBuffer::TYPE_ALBEDO, the scene is only drawn into the g buffer
+            INPUT_LIGHT_PASS  // GBuffer::TYPE_LIGHT_PASS, drawn after the geometry with beginGbuffer(cam, GBuffer::MODE_LIGHT)
+        };
         
-        void beginGbuffer(ofCamera& cam) {
-            gbuffer.begin(cam);
+        Processor() : backend(BACKEND_GL), inputSource(INPUT_RAW), inputTexture(NULL), upscaled(NULL), fusionEnabled(true), readbackEnabled(false), offlineFrameRate(0),
+            resolutionScale(1), dynamicResolution(false), lastControlledFrame(numeric_limits<uint64_t>::max()), upscalePending(false), jitterEnabled(false), cpuTextureDirty(false) {
+            pingPong[0] = pingPong[1] = NULL;
+        }
+        
+        void init(unsigned width = ofGetWidth(), unsigned height = ofGetHeight(), Backend backend = BACKEND_GL);
+        Backend getBackend() const { return backend; }
+        
+        // false while any pass is still compiling its shaders,
+        // e.g. to hold back the first frame of an offline render
+        bool isReady();
+        
+        // BACKEND_GL only, fill getCpuGBufferRef() and getRawPixelsRef() with the cpu backend
+        void beginGbuffer(ofCamera& cam, GBuffer::Mode mode = GBuffer::MODE_GEOMETRY) {
+            if (backend != BACKEND_GL) return;
+            profiler.begin(mode == GBuffer::MODE_LIGHT ? "LightPass" : "GBuffer");
+            updateCamera(cam);
+            gbuffer.begin(cameraData, mode);
         }
         void endGbuffer() {
+            if (backend != BACKEND_GL) return;
             gbuffer.end();
+            profiler.end();
         }
         
+        // With an input other than INPUT_RAW nothing is drawn between begin() and end(),
+        // they only update and run the passes on the g buffer of this frame.
         void begin(ofCamera& cam);
         void end(bool autoDraw = true);
         
+        // BACKEND_GL, INPUT_RAW by default
+        void setInputSource(InputSource inputSource) { this->inputSource = inputSource; }
+        InputSource getInputSource() const { return inputSource; }
+        
         // float rather than int and not const to override ofBaseDraws
         void draw(float x = 0.f, float y = 0.f) const ;
         void draw(float x, float y, float w, float h) const ;
@@ -58,7 +159,12 @@ namespace DeferredEffect {
         template<class T>
         shared_ptr<T> createPass()
         {
+            RenderPass::creationBackend = backend;
             shared_ptr<T> pass = shared_ptr<T>(new T(ofVec2f(width, height)));
+            RenderPass::creationBackend = BACKEND_GL;
+            pass->targetPool = &targetPool;
+            pass->cameraData = &cameraData;
+            pass->setFrameRate(offlineFrameRate);
             passes.push_back(pass);
             return pass;
         }
@@ -67,6 +173,7 @@ namespace DeferredEffect {
         
         // advanced
         void process(ofFbo& raw);
+        void process(const ofFloatPixels& raw);
         
         unsigned size() const { return passes.size(); }
         RenderPass::Ptr operator[](unsigned i) const { return passes[i]; }
@@ -76,17 +183,130 @@ namespace DeferredEffect {
         ofFbo& getRawRef() { return raw; }
         
         GBuffer& getGBufferRef() { return gbuffer; }
+        // the camera of the frame, updated by the first beginGbuffer() or begin() of it
+        CameraData& getCameraDataRef() { return cameraData; }
+        // BACKEND_GL, reallocates the g buffer after init()
+        void setGBufferLayout(GBuffer::Layout layout) {
+            if (backend == BACKEND_GL) gbuffer.setup(width, height, layout);
+        }
+        
+        // BACKEND_CPU
+        CpuGBuffer& getCpuGBufferRef() { return cpuGbuffer; }
+        ofFloatPixels& getRawPixelsRef() { return cpuRaw; }
+        const ofFloatPixels& getProcessedPixelsRef() const;
+        ThreadPool& getThreadPoolRef() { return pool; }
+        
+        // per pass timings, keyed by RenderPass::getName(), "GBuffer", "LightPass", "Raw",
+        // "Upscale" and "Readback"
+        void setProfilingEnabled(bool enabled) { profiler.setEnabled(enabled); }
+        bool isProfilingEnabled() const { return profiler.isEnabled(); }
+        Profiler::Stats getPassStats(const string& name) const { return profiler.getStats(name); }
+        bool saveChromeTrace(const string& path) const { return profiler.saveChromeTrace(path); }
+        Profiler& getProfilerRef() { return profiler; }
+        
+        // BACKEND_GL, the ping pongs and the transient targets of the passes,
+        // getTargetPoolRef().getMemoryUsage() is the video memory they take
+        RenderTargetPool& getTargetPoolRef() { return targetPool; }
+        
+        // BACKEND_GL, end() queues the readback of the processed texture, the
+        // frames come out of getReadbackRef() a few frames later, off by default
+        void setReadbackEnabled(bool enabled) { readbackEnabled = enabled; }
+        bool isReadbackEnabled() const { return readbackEnabled; }
+        FrameReadback& getReadbackRef() { return readback; }
+        
+        // BACKEND_GL, offline rendering of an image sequence : the passes get fps
+        // instead of ofGetFrameRate() and every frame processed by end() is read
+        // back and saved to directory (see FrameEncoder), none is dropped.
+        // The app steps its own time by 1 / fps per frame.
+        void beginOffline(const string& directory, float fps, FrameEncoder::Format format = FrameEncoder::FORMAT_PNG);
+        // waits until every frame is written
+        void endOffline();
+        bool isOffline() const { return offlineFrameRate > 0; }
+        FrameEncoder& getEncoderRef() { return encoder; }
+        
+        // BACKEND_GL, adjacent point-wise passes are drawn at once, on by default
+        void setFusionEnabled(bool enabled) { fusionEnabled = enabled; }
+        bool isFusionEnabled() const { return fusionEnabled; }
+        
+        // BACKEND_GL, the g buffer, raw and the passes render to the lower left
+        // getRenderWidth() x getRenderHeight() of their targets, nothing is
+        // reallocated. The result is upscaled to the full size. 1 by default,
+        // set by the controller with dynamic resolution.
+        void setResolutionScale(float scale) { resolutionScale = ofClamp(scale, 0.f, 1.f); }
+        float getResolutionScale() const { return resolutionScale; }
+        unsigned getRenderWidth() const { return renderSize.x; }
+        unsigned getRenderHeight() const { return renderSize.y; }
+        
+        // BACKEND_GL, the scale follows the gpu time the profiler measures, see
+        // ResolutionController. Turns profiling on, off by default
+        void setDynamicResolutionEnabled(bool enabled);
+        bool isDynamicResolutionEnabled() const { return dynamicResolution; }
+        ResolutionController& getResolutionControllerRef() { return resolutionController; }
+        
+        // BACKEND_GL, offsets the projection of every frame by a sub-pixel Halton (2, 3)
+        // sequence for a TemporalAccumulationPass to converge over, see CameraData::getJitter().
+        // The g buffer velocity leaves it out. Off by default
+        void setJitterEnabled(bool enabled) { jitterEnabled = enabled; }
+        bool isJitterEnabled() const { return jitterEnabled; }
     private:
         void process();
+        void updateCamera(ofCamera& cam);
+        void updateResolution();
+        void upscale(ofTexture& texture);
+        ofFbo& acquirePingPong(unsigned i);
+        void releasePingPong(unsigned i);
+        ofShader* getFusedShader(const vector<RenderPass::Ptr>& fused);
+        void renderFused(const vector<RenderPass::Ptr>& fused, ofShader& shader, ofFbo& readFbo, ofFbo& writeFbo);
         
         unsigned currentReadFbo;
         unsigned numProcessedPasses;
         unsigned width, height;
         
+        Backend backend;
         GBuffer gbuffer;
+        CameraData cameraData;
+        Profiler profiler;
         ofFbo raw;
-        ofFbo pingPong[2];
+        InputSource inputSource;
+        // what process() started from, drawn when no pass was
+        ofTexture* inputTexture;
+        // from targetPool, acquired once a pass writes to them, the result is kept until the next frame
+        ofFbo* pingPong[2];
+        // the full size result when rendered below it
+        ofFbo* upscaled;
+        RenderTargetPool targetPool;
         vector<RenderPass::Ptr> passes;
+        
+        bool fusionEnabled;
+        // keyed by the generated fragment source
+        map<string, ofShader> fusedShaders;
+        map<string, ShaderCache::Job> pendingFusedShaders;
+        
+        bool readbackEnabled;
+        FrameReadback readback;
+        float offlineFrameRate;
+        FrameEncoder encoder;
+        
+        float resolutionScale;
+        ofVec2f renderSize;
+        bool dynamicResolution;
+        ResolutionController resolutionController;
+        // ofGetFrameNum() and scale of the frames the profiler hasn't measured yet
+        deque<pair<uint64_t, float> > frameScales;
+        uint64_t lastControlledFrame;
+        ofShader upscaleShader;
+        ShaderCache::Job upscaleJob;
+        bool upscalePending;
+        bool jitterEnabled;
+        
+        CpuGBuffer cpuGbuffer;
+        ofFloatPixels cpuRaw;
+        ofFloatPixels cpuPingPong[2];
+        ThreadPool pool;
+        // uploaded on demand when a cpu result gets drawn
+        mutable ofTexture cpuTexture;
+        mutable bool cpuTextureDirty;
+        void updateCpuTexture() const;
     };
    
 }
\ No newline at end of file
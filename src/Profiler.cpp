@@ -0,0 +1,250 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "Profiler.h"
+#include <numeric>
+
+using namespace DeferredEffect;
+
+static string escapeJson(const string& str) {
+    string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+Profiler::Profiler() : enabled(false), gpuTimer(false), windowSize(60), traceFrames(0),
+    frameStarted(false), currentFrameNum(0), current(0), lastFrameGpuTime(0), lastGpuFrameNum(numeric_limits<uint64_t>::max())
+{
+}
+
+Profiler::~Profiler()
+{
+    for (int i = 0; i < NUM_QUERY_FRAMES; ++i) {
+        if (!frames[i].queries.empty()) {
+            glDeleteQueries(frames[i].queries.size(), &frames[i].queries[0]);
+        }
+    }
+}
+
+void Profiler::begin(const string& name)
+{
+    if (!enabled) return;
+    if (!frameStarted || ofGetFrameNum() != currentFrameNum) {
+        beginFrame();
+    }
+
+    Frame& frame = frames[current];
+    Sample sample;
+    sample.name = name;
+    sample.depth = openSamples.size();
+    sample.cpuStart = ofGetElapsedTimeMicros();
+    sample.cpuEnd = 0;
+    sample.gpuStart = sample.gpuEnd = 0;
+    sample.hasGpu = gpuTimer;
+    if (gpuTimer) {
+        size_t index = frame.samples.size() * 2;
+        if (frame.queries.size() < index + 2) {
+            frame.queries.resize(index + 2);
+            glGenQueries(2, &frame.queries[index]);
+        }
+        glQueryCounter(frame.queries[index], GL_TIMESTAMP);
+    }
+    openSamples.push_back(frame.samples.size());
+    frame.samples.push_back(sample);
+}
+
+void Profiler::end()
+{
+    if (openSamples.empty()) return;
+
+    Frame& frame = frames[current];
+    int index = openSamples.back();
+    openSamples.pop_back();
+    Sample& sample = frame.samples[index];
+    if (sample.hasGpu) {
+        glQueryCounter(frame.queries[index * 2 + 1], GL_TIMESTAMP);
+    }
+    sample.cpuEnd = ofGetElapsedTimeMicros();
+}
+
+void Profiler::beginFrame()
+{
+    if (!frameStarted) {
+#ifndef TARGET_OPENGLES
+        gpuTimer = GLEW_ARB_timer_query;
+#endif
+    } else {
+        // samples left open at the end of a frame are dropped
+        for (int index : openSamples) {
+            frames[current].samples[index].cpuEnd = 0;
+        }
+        openSamples.clear();
+        frames[current].pending = true;
+    }
+
+    for (int i = 0; i < NUM_QUERY_FRAMES; ++i) {
+        if (frames[i].pending && resolve(frames[i])) {
+            record(frames[i]);
+            frames[i].pending = false;
+        }
+    }
+
+    current = (current + 1) % NUM_QUERY_FRAMES;
+    Frame& frame = frames[current];
+    if (frame.pending) {
+        // the gpu is more than NUM_QUERY_FRAMES behind, drop its timings rather than wait
+        for (Sample& sample : frame.samples) {
+            sample.hasGpu = false;
+        }
+        record(frame);
+        frame.pending = false;
+    }
+    frame.frameNum = ofGetFrameNum();
+    frame.samples.clear();
+    currentFrameNum = frame.frameNum;
+    frameStarted = true;
+}
+
+bool Profiler::resolve(Frame& frame)
+{
+    // timestamps complete in order, so the last one tells about all of them
+    int last = -1;
+    for (int i = 0; i < frame.samples.size(); ++i) {
+        if (frame.samples[i].hasGpu && frame.samples[i].cpuEnd) last = i;
+    }
+    if (last < 0) return true;
+
+    GLint available = 0;
+    glGetQueryObjectiv(frame.queries[last * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return false;
+
+    for (int i = 0; i < frame.samples.size(); ++i) {
+        Sample& sample = frame.samples[i];
+        if (!sample.hasGpu || !sample.cpuEnd) continue;
+        GLuint64 start, end;
+        glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+        sample.gpuStart = start;
+        sample.gpuEnd = end;
+    }
+    return true;
+}
+
+void Profiler::record(const Frame& frame)
+{
+    float frameGpuTime = 0;
+    bool hasGpu = false;
+    for (const Sample& sample : frame.samples) {
+        if (!sample.cpuEnd) continue;
+        History& history = histories[sample.name];
+        history.cpu.push_back((sample.cpuEnd - sample.cpuStart) * 1e-3f);
+        if (sample.hasGpu) {
+            float gpuTime = (sample.gpuEnd - sample.gpuStart) * 1e-6f;
+            history.gpu.push_back(gpuTime);
+            if (sample.depth == 0) {
+                frameGpuTime += gpuTime;
+                hasGpu = true;
+            }
+        }
+        while (history.cpu.size() > windowSize) history.cpu.pop_front();
+        while (history.gpu.size() > windowSize) history.gpu.pop_front();
+    }
+    // frames may resolve out of order within one beginFrame()
+    bool newer = lastGpuFrameNum == numeric_limits<uint64_t>::max() || frame.frameNum > lastGpuFrameNum;
+    if (hasGpu && newer) {
+        lastFrameGpuTime = frameGpuTime;
+        lastGpuFrameNum = frame.frameNum;
+    }
+
+    if (traceFrames > 0) {
+        trace.push_back(frame);
+    }
+    while (trace.size() > traceFrames) {
+        trace.pop_front();
+    }
+}
+
+void Profiler::clear()
+{
+    for (int i = 0; i < NUM_QUERY_FRAMES; ++i) {
+        frames[i].samples.clear();
+        frames[i].pending = false;
+    }
+    openSamples.clear();
+    histories.clear();
+    trace.clear();
+    lastFrameGpuTime = 0;
+    lastGpuFrameNum = numeric_limits<uint64_t>::max();
+}
+
+Profiler::Stats Profiler::getStats(const string& name) const
+{
+    Stats stats;
+    map<string, History>::const_iterator it = histories.find(name);
+    if (it == histories.end()) return stats;
+
+    const History& history = it->second;
+    stats.numSamples = history.cpu.size();
+    if (!history.cpu.empty()) {
+        stats.cpuMin = *min_element(history.cpu.begin(), history.cpu.end());
+        stats.cpuMax = *max_element(history.cpu.begin(), history.cpu.end());
+        stats.cpuAvg = accumulate(history.cpu.begin(), history.cpu.end(), 0.f) / history.cpu.size();
+    }
+    if (!history.gpu.empty()) {
+        stats.gpuMin = *min_element(history.gpu.begin(), history.gpu.end());
+        stats.gpuMax = *max_element(history.gpu.begin(), history.gpu.end());
+        stats.gpuAvg = accumulate(history.gpu.begin(), history.gpu.end(), 0.f) / history.gpu.size();
+    }
+    return stats;
+}
+
+vector<string> Profiler::getNames() const
+{
+    vector<string> names;
+    for (map<string, History>::const_iterator it = histories.begin(); it != histories.end(); ++it) {
+        names.push_back(it->first);
+    }
+    return names;
+}
+
+bool Profiler::saveChromeTrace(const string& path) const
+{
+    ofstream file(ofToDataPath(path).c_str());
+    if (!file) {
+        ofLogError("Profiler") << "could not open " << path;
+        return false;
+    }
+
+    file << "{\"traceEvents\":[" << endl;
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"CPU\"}}," << endl;
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"GPU\"}}";
+    for (const Frame& frame : trace) {
+        // gpu timestamps are on their own clock, line the first one up with its cpu scope
+        double gpuOffset = 0;
+        for (const Sample& sample : frame.samples) {
+            if (sample.hasGpu && sample.cpuEnd) {
+                gpuOffset = double(sample.cpuStart) - sample.gpuStart * 1e-3;
+                break;
+            }
+        }
+        for (const Sample& sample : frame.samples) {
+            if (!sample.cpuEnd) continue;
+            string name = escapeJson(sample.name);
+            file << "," << endl << "{\"name\":\"" << name << "\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":0,\"tid\":0"
+                 << ",\"ts\":" << sample.cpuStart << ",\"dur\":" << (sample.cpuEnd - sample.cpuStart)
+                 << ",\"args\":{\"frame\":" << frame.frameNum << "}}";
+            if (sample.hasGpu) {
+                file << "," << endl << "{\"name\":\"" << name << "\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":1"
+                     << ",\"ts\":" << ofToString(sample.gpuStart * 1e-3 + gpuOffset, 3)
+                     << ",\"dur\":" << ofToString((sample.gpuEnd - sample.gpuStart) * 1e-3, 3)
+                     << ",\"args\":{\"frame\":" << frame.frameNum << "}}";
+            }
+        }
+    }
+    file << endl << "],\"displayTimeUnit\":\"ms\"}" << endl;
+    return true;
+}
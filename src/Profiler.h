@@ -0,0 +1,100 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // CPU and GPU time of named scopes, e.g. every RenderPass::render.
+    // GPU times come from GL timestamp queries that are read back a few frames
+    // later only once they are available, so profiling never stalls the pipeline.
+    class Profiler {
+    public:
+        // milliseconds over the rolling window
+        struct Stats {
+            float cpuMin, cpuAvg, cpuMax;
+            float gpuMin, gpuAvg, gpuMax;
+            int numSamples;
+            Stats() : cpuMin(0), cpuAvg(0), cpuMax(0), gpuMin(0), gpuAvg(0), gpuMax(0), numSamples(0) {}
+        };
+
+        Profiler();
+        ~Profiler();
+
+        void setEnabled(bool enabled) { this->enabled = enabled; }
+        bool isEnabled() const { return enabled; }
+        bool& getEnabledRef() { return enabled; }
+
+        // false until the first frame was profiled or without ARB_timer_query
+        bool isGpuTimerAvailable() const { return gpuTimer; }
+
+        // number of frames the min / avg / max are computed over
+        void setWindowSize(int frames) { windowSize = max(frames, 1); }
+        int getWindowSize() const { return windowSize; }
+
+        // number of frames kept for saveChromeTrace(), 0 to disable
+        void setTraceFrames(int frames) { traceFrames = max(frames, 0); }
+        int getTraceFrames() const { return traceFrames; }
+
+        // scopes can be nested
+        void begin(const string& name);
+        void end();
+
+        // forget all stats, trace and timings still in flight
+        void clear();
+
+        // gpu milliseconds of the top level scopes of the latest frame whose queries
+        // came back, and its ofGetFrameNum(), the max value before the first one
+        float getLastFrameGpuTime() const { return lastFrameGpuTime; }
+        uint64_t getLastGpuFrameNum() const { return lastGpuFrameNum; }
+
+        bool hasStats(const string& name) const { return histories.count(name) > 0; }
+        Stats getStats(const string& name) const;
+        vector<string> getNames() const;
+
+        // chrome://tracing / Perfetto json of the last getTraceFrames() frames
+        bool saveChromeTrace(const string& path) const;
+
+    private:
+        static const int NUM_QUERY_FRAMES = 4;
+
+        struct Sample {
+            string name;
+            int depth;
+            uint64_t cpuStart, cpuEnd; // microseconds
+            uint64_t gpuStart, gpuEnd; // nanoseconds
+            bool hasGpu;
+        };
+        struct Frame {
+            uint64_t frameNum;
+            vector<Sample> samples;
+            vector<GLuint> queries; // two per sample
+            bool pending;
+            Frame() : frameNum(0), pending(false) {}
+        };
+        struct History {
+            deque<float> cpu;
+            deque<float> gpu;
+        };
+
+        void beginFrame();
+        bool resolve(Frame& frame);
+        void record(const Frame& frame);
+
+        bool enabled;
+        bool gpuTimer;
+        int windowSize;
+        int traceFrames;
+        bool frameStarted;
+        uint64_t currentFrameNum;
+        int current;
+        Frame frames[NUM_QUERY_FRAMES];
+        vector<int> openSamples;
+        map<string, History> histories;
+        deque<Frame> trace;
+        float lastFrameGpuTime;
+        uint64_t lastGpuFrameNum;
+    };
+
+}
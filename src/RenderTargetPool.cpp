@@ -0,0 +1,100 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "RenderTargetPool.h"
+
+using namespace DeferredEffect;
+
+ofFbo& RenderTargetPool::acquire(int width, int height, int internalFormat)
+{
+    width = max(width, 1);
+    height = max(height, 1);
+    for (auto& target : targets) {
+        if (!target.inUse && target.width == width && target.height == height && target.internalFormat == internalFormat) {
+            target.inUse = true;
+            target.lastUsedFrame = frame;
+            return *target.fbo;
+        }
+    }
+
+    Target target;
+    target.fbo = shared_ptr<ofFbo>(new ofFbo());
+    target.fbo->allocate(width, height, internalFormat);
+    target.width = width;
+    target.height = height;
+    target.internalFormat = internalFormat;
+    target.inUse = true;
+    target.lastUsedFrame = frame;
+    targets.push_back(target);
+    ofLogVerbose("RenderTargetPool") << "allocated " << width << "x" << height << ", " << getMemoryUsage() / (1024 * 1024) << " MB pooled";
+    return *target.fbo;
+}
+
+void RenderTargetPool::release(ofFbo& fbo)
+{
+    for (auto& target : targets) {
+        if (target.fbo.get() == &fbo) {
+            target.inUse = false;
+            target.lastUsedFrame = frame;
+            return;
+        }
+    }
+    ofLogWarning("RenderTargetPool") << "release of an fbo that is not pooled";
+}
+
+void RenderTargetPool::endFrame()
+{
+    for (auto it = targets.begin(); it != targets.end();) {
+        if (!it->inUse && frame - it->lastUsedFrame > maxIdleFrames) it = targets.erase(it);
+        else ++it;
+    }
+    frame++;
+}
+
+void RenderTargetPool::clear()
+{
+    targets.clear();
+}
+
+size_t RenderTargetPool::getMemoryUsage() const
+{
+    size_t bytes = 0;
+    for (auto& target : targets) {
+        bytes += size_t(target.width) * target.height * getBytesPerPixel(target.internalFormat);
+    }
+    return bytes;
+}
+
+unsigned RenderTargetPool::getNumTargetsInUse() const
+{
+    unsigned numInUse = 0;
+    for (auto& target : targets) {
+        if (target.inUse) numInUse++;
+    }
+    return numInUse;
+}
+
+// drivers pad 3 channel formats to 4
+size_t RenderTargetPool::getBytesPerPixel(int internalFormat)
+{
+    switch (internalFormat) {
+        case GL_R8:
+            return 1;
+        case GL_RG8:
+        case GL_R16F:
+            return 2;
+        case GL_RG16F:
+        case GL_R32F:
+            return 4;
+        case GL_RG32F:
+        case GL_RGB16F:
+        case GL_RGBA16F:
+            return 8;
+        case GL_RGB32F:
+        case GL_RGBA32F:
+            return 16;
+        default:
+            return 4;
+    }
+}
@@ -0,0 +1,51 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // Transient fbos handed out by size and internal format. A released target is
+    // handed out again to the next request with the same size and format, so
+    // passes whose targets don't live at the same time share video memory.
+    // Targets nobody acquired for a while are freed, e.g. those of disabled passes.
+    class RenderTargetPool {
+    public:
+        RenderTargetPool() : frame(0), maxIdleFrames(60) {}
+
+        // contents are undefined, the fbo stays valid until release()
+        ofFbo& acquire(int width, int height, int internalFormat);
+        // the fbo may be handed out again right away, within the same frame
+        void release(ofFbo& fbo);
+
+        // once per frame, frees the targets idle for more than getMaxIdleFrames()
+        void endFrame();
+        // frees every target, in use or not
+        void clear();
+
+        void setMaxIdleFrames(unsigned frames) { maxIdleFrames = frames; }
+        unsigned getMaxIdleFrames() const { return maxIdleFrames; }
+
+        // estimated video memory of all pooled targets, in use or not, in bytes
+        size_t getMemoryUsage() const;
+        unsigned getNumTargets() const { return targets.size(); }
+        unsigned getNumTargetsInUse() const;
+
+        static size_t getBytesPerPixel(int internalFormat);
+
+    private:
+        struct Target {
+            // fbos don't move when targets grows
+            shared_ptr<ofFbo> fbo;
+            int width, height;
+            int internalFormat;
+            bool inUse;
+            unsigned lastUsedFrame;
+        };
+        vector<Target> targets;
+        unsigned frame;
+        unsigned maxIdleFrames;
+    };
+
+}
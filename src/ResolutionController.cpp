@@ -0,0 +1,45 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "ResolutionController.h"
+
+using namespace DeferredEffect;
+
+// weight of the newest frame in the smoothed time
+static const float SMOOTHING = 0.1f;
+// changes smaller than this are ignored
+static const float DEAD_BAND = 0.02f;
+// the most the scale grows per frame
+static const float MAX_STEP_UP = 0.05f;
+
+void ResolutionController::setScaleRange(float minScale, float maxScale)
+{
+    this->minScale = ofClamp(minScale, 0.1f, 1.f);
+    this->maxScale = ofClamp(maxScale, this->minScale, 1.f);
+    scale = ofClamp(scale, this->minScale, this->maxScale);
+}
+
+float ResolutionController::update(float gpuTime, float frameScale)
+{
+    if (gpuTime <= 0 || frameScale <= 0) return scale;
+
+    float time = gpuTime / (frameScale * frameScale);
+    fullTime = fullTime > 0 ? ofLerp(fullTime, time, SMOOTHING) : time;
+
+    float ideal = ofClamp(sqrt(targetTime / fullTime), minScale, maxScale);
+    // the limits are reached even from within the dead band
+    bool atLimit = ideal == minScale || ideal == maxScale;
+    if (ideal < scale && (scale - ideal > DEAD_BAND || atLimit)) {
+        scale = ideal;
+    } else if (ideal > scale && (ideal - scale > DEAD_BAND || atLimit)) {
+        scale = min(ideal, scale + MAX_STEP_UP);
+    }
+    return scale;
+}
+
+void ResolutionController::reset()
+{
+    scale = maxScale;
+    fullTime = 0;
+}
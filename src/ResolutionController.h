@@ -0,0 +1,43 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // Picks the render scale that keeps the gpu time of a frame within a budget.
+    // The time of the scaled work is assumed to go with the number of pixels, so
+    // every measured frame gives an estimate of the full resolution time, which is
+    // smoothed over frames. The scale drops as soon as that is over the budget
+    // and grows back in small steps, within a dead band against oscillation.
+    class ResolutionController {
+    public:
+        ResolutionController() : targetTime(14.f), minScale(0.5f), maxScale(1.f), scale(1.f), fullTime(0) {}
+
+        // gpu milliseconds per frame, 14 by default to leave some headroom at 60 fps
+        void setTargetTime(float ms) { targetTime = max(ms, 0.1f); }
+        float getTargetTime() const { return targetTime; }
+
+        // of the width and height, 0.5 - 1 by default
+        void setScaleRange(float minScale, float maxScale);
+        float getMinScale() const { return minScale; }
+        float getMaxScale() const { return maxScale; }
+
+        // the gpu time of a frame rendered at frameScale, returns the scale of the next
+        float update(float gpuTime, float frameScale);
+        float getScale() const { return scale; }
+
+        // back to the max scale, forgets the measured times
+        void reset();
+
+    private:
+        float targetTime;
+        float minScale;
+        float maxScale;
+        float scale;
+        // smoothed estimate at scale 1, 0 until the first update()
+        float fullTime;
+    };
+
+}
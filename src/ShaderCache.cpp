@@ -0,0 +1,241 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "ShaderCache.h"
+#include "CoreProfile.h"
+#include <iomanip>
+
+using namespace DeferredEffect;
+
+bool ShaderCache::enabled = true;
+string ShaderCache::directory = "shadercache";
+
+// FNV-1a, 64 bit
+static void hashBytes(uint64_t& hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+static void hashString(uint64_t& hash, const string& str) {
+    // the terminator keeps "ab" + "c" apart from "a" + "bc"
+    hashBytes(hash, str.c_str(), str.size() + 1);
+}
+
+// ofShader 0.10 and later look uniforms up in a table linkProgram() fills, so
+// a program it didn't link itself (a loaded binary, or one linked on the
+// driver threads) would find none of them. Those versions only link through
+// ofShader, without the cache or background compiling.
+static bool canReplaceProgram() {
+#if OF_VERSION_MAJOR > 0 || OF_VERSION_MINOR >= 10
+    return false;
+#else
+    return true;
+#endif
+}
+
+// KHR_parallel_shader_compile is newer than some GLEW versions
+static bool isParallelCompileAvailable() {
+#ifdef GL_KHR_parallel_shader_compile
+    return GLEW_KHR_parallel_shader_compile;
+#else
+    return false;
+#endif
+}
+
+static string getGLString(GLenum name) {
+    const GLubyte* str = glGetString(name);
+    return str ? string(reinterpret_cast<const char*>(str)) : string();
+}
+
+bool ShaderCache::setup(ofShader& shader, const Sources& legacySources)
+{
+    shader.unload();
+    Sources sources = CoreProfile::adapt(legacySources);
+
+    string path;
+    if (enabled && isAvailable()) {
+        path = getPath(sources);
+        if (load(shader, path)) {
+            ofLogVerbose("ShaderCache") << "loaded " << path;
+            return true;
+        }
+    }
+
+    bool compiled = true;
+    for (auto& stage : sources) {
+        compiled = shader.setupShaderFromSource(stage.first, stage.second) && compiled;
+    }
+    if (!path.empty()) {
+        glProgramParameteri(shader.getProgram(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    if (!shader.linkProgram() || !compiled) {
+        return false;
+    }
+    if (!path.empty()) {
+        save(shader, path);
+    }
+    return true;
+}
+
+bool ShaderCache::setupAsync(ofShader& shader, const Sources& legacySources, Job& job)
+{
+    shader.unload();
+    job.shader = &shader;
+    // poll() adapts them again in setup()
+    job.sources = legacySources;
+    Sources sources = CoreProfile::adapt(legacySources);
+    job.path.clear();
+    job.submitted = false;
+
+    if (enabled && isAvailable()) {
+        job.path = getPath(sources);
+        if (load(shader, job.path)) {
+            ofLogVerbose("ShaderCache") << "loaded " << job.path;
+            return false;
+        }
+    }
+    // compiled by poll() then
+    if (!isParallelCompileAvailable() || !canReplaceProgram()) return true;
+
+    // ofShader's program with our shaders instead of the trivial one, compiled
+    // and linked without any status query so the driver threads do the work
+    createProgram(shader);
+    GLuint program = shader.getProgram();
+    GLuint attached[8];
+    GLsizei numAttached = 0;
+    glGetAttachedShaders(program, 8, &numAttached, attached);
+    for (int i = 0; i < numAttached; ++i) {
+        glDetachShader(program, attached[i]);
+    }
+    for (auto& stage : sources) {
+        GLuint stageShader = glCreateShader(stage.first);
+        const char* src = stage.second.c_str();
+        glShaderSource(stageShader, 1, &src, NULL);
+        glCompileShader(stageShader);
+        glAttachShader(program, stageShader);
+        // deleted along with the program
+        glDeleteShader(stageShader);
+    }
+    if (!job.path.empty()) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(program);
+    job.submitted = true;
+    return true;
+}
+
+bool ShaderCache::poll(Job& job)
+{
+    if (!job.submitted) {
+        // at most one blocking compile per frame
+        static uint64_t lastCompileFrame = numeric_limits<uint64_t>::max();
+        if (lastCompileFrame == ofGetFrameNum()) return false;
+        lastCompileFrame = ofGetFrameNum();
+        setup(*job.shader, job.sources);
+        return true;
+    }
+
+#ifdef GL_KHR_parallel_shader_compile
+    GLuint program = job.shader->getProgram();
+    GLint completed = GL_FALSE;
+    glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &completed);
+    if (completed != GL_TRUE) return false;
+
+    if (isLinked(*job.shader)) {
+        if (!job.path.empty()) {
+            save(*job.shader, job.path);
+        }
+    } else {
+        GLint length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        vector<char> log(max(length, 1));
+        glGetProgramInfoLog(program, log.size(), NULL, &log[0]);
+        ofLogError("ShaderCache") << "linking failed : " << &log[0];
+    }
+#endif
+    return true;
+}
+
+bool ShaderCache::isLinked(const ofShader& shader)
+{
+    GLint status = GL_FALSE;
+    glGetProgramiv(shader.getProgram(), GL_LINK_STATUS, &status);
+    return status == GL_TRUE;
+}
+
+void ShaderCache::createProgram(ofShader& shader)
+{
+    Sources sources;
+    sources[GL_FRAGMENT_SHADER] = "void main() { gl_FragColor = vec4(0.0); }";
+    for (auto& stage : CoreProfile::adapt(sources)) {
+        shader.setupShaderFromSource(stage.first, stage.second);
+    }
+    shader.linkProgram();
+}
+
+bool ShaderCache::isAvailable()
+{
+    if (!GLEW_ARB_get_program_binary || !canReplaceProgram()) return false;
+    GLint numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    return numFormats > 0;
+}
+
+string ShaderCache::getPath(const Sources& sources)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    hashString(hash, getGLString(GL_VENDOR));
+    hashString(hash, getGLString(GL_RENDERER));
+    hashString(hash, getGLString(GL_VERSION));
+    for (auto& stage : sources) {
+        GLenum type = stage.first;
+        hashBytes(hash, &type, sizeof(type));
+        hashString(hash, stage.second);
+    }
+
+    stringstream name;
+    name << hex << setw(16) << setfill('0') << hash << ".bin";
+    return ofToDataPath(directory + "/" + name.str(), true);
+}
+
+// file layout : binary format (GLenum), program binary
+bool ShaderCache::load(ofShader& shader, const string& path)
+{
+    if (!ofFile::doesFileExist(path, false)) return false;
+    ofBuffer buffer = ofBufferFromFile(path, true);
+    if (buffer.size() <= sizeof(GLenum)) return false;
+
+    GLenum format;
+    memcpy(&format, buffer.getBinaryBuffer(), sizeof(format));
+
+    createProgram(shader);
+    glProgramBinary(shader.getProgram(), format, buffer.getBinaryBuffer() + sizeof(format), buffer.size() - sizeof(format));
+    if (!isLinked(shader)) {
+        ofLogVerbose("ShaderCache") << "stale binary " << path;
+        shader.unload();
+        return false;
+    }
+    return true;
+}
+
+void ShaderCache::save(const ofShader& shader, const string& path)
+{
+    GLint length = 0;
+    glGetProgramiv(shader.getProgram(), GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    vector<char> data(sizeof(GLenum) + length);
+    GLenum format = 0;
+    glGetProgramBinary(shader.getProgram(), length, &length, &format, &data[sizeof(GLenum)]);
+    memcpy(&data[0], &format, sizeof(format));
+
+    ofDirectory::createDirectory(directory, true, true);
+    ofBuffer buffer(&data[0], sizeof(GLenum) + length);
+    if (!ofBufferToFile(path, buffer, true)) {
+        ofLogWarning("ShaderCache") << "couldn't write " << path;
+    }
+}
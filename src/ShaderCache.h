@@ -0,0 +1,64 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+
+namespace DeferredEffect {
+
+    // Stores linked programs on disk with glGetProgramBinary, so later launches
+    // load them instead of compiling. A program is keyed by the hash of its
+    // sources and the GL vendor / renderer / version strings; a binary the
+    // driver rejects (e.g. after an update) is compiled and stored again.
+    // Without ARB_get_program_binary every program is compiled as usual.
+    // Binaries and background compiling need openFrameworks 0.9, whose ofShader
+    // looks uniform locations up on the program it holds. With 0.10 and later,
+    // setup() always compiles and setupAsync() compiles in poll().
+    class ShaderCache {
+    public:
+        // shader stage -> source
+        typedef map<GLenum, string> Sources;
+
+        // compiles and links sources into shader, or loads the stored binary.
+        // false when compiling or linking failed. The sources are GLSL 1.20,
+        // CoreProfile::adapt() is applied with the programmable renderer.
+        static bool setup(ofShader& shader, const Sources& sources);
+
+        // A program set up by setupAsync(), finished by poll().
+        struct Job {
+            ofShader* shader;
+            Sources sources;
+            string path;
+            bool submitted; // compiling on the driver threads
+        };
+        // Starts compiling and linking sources into shader and returns true if
+        // poll() has to finish it, false when the stored binary was loaded.
+        // With KHR_parallel_shader_compile the driver compiles in the background,
+        // otherwise poll() compiles synchronously, one program per frame.
+        static bool setupAsync(ofShader& shader, const Sources& sources, Job& job);
+        // true once the job is done, linked or not
+        static bool poll(Job& job);
+
+        static bool isLinked(const ofShader& shader);
+
+        static void setEnabled(bool enabled) { ShaderCache::enabled = enabled; }
+        static bool isEnabled() { return enabled; }
+
+        // relative to the data folder, "shadercache" by default
+        static void setDirectory(const string& directory) { ShaderCache::directory = directory; }
+        static const string& getDirectory() { return directory; }
+
+    private:
+        static bool isAvailable();
+        // ofShader only creates its program object while compiling, so a trivial
+        // one is linked first, loaded binaries and async shaders then replace it
+        static void createProgram(ofShader& shader);
+        static string getPath(const Sources& sources);
+        static bool load(ofShader& shader, const string& path);
+        static void save(const ofShader& shader, const string& path);
+
+        static bool enabled;
+        static string directory;
+    };
+
+}
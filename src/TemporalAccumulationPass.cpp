@@ -0,0 +1,129 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "TemporalAccumulationPass.h"
+#define STRINGIFY(A) #A
+using namespace DeferredEffect;
+
+static inline ShaderCache::Sources sourcesWithHeader(const string& frag) {
+    ShaderCache::Sources sources;
+    sources[GL_FRAGMENT_SHADER] = GBuffer::getShaderHeader() + frag;
+    return sources;
+}
+
+TemporalAccumulationPass::TemporalAccumulationPass(const ofVec2f& sz) : RenderPass(sz, "TemporalAccumulationPass"),
+    currentHistory(0), historyValid(false), cutCount(0),
+    blend(0.1f), depthThreshold(0.05f), neighbourhoodClamp(true)
+{
+    if (backend != BACKEND_GL) return;
+
+    // the reprojection reads the history between texels
+    for (int i = 0; i < 2; ++i) {
+        history[i].allocate(sz.x, sz.y, GL_RGBA16F);
+        history[i].getTextureReference().setTextureMinMagFilter(GL_LINEAR, GL_LINEAR);
+    }
+
+    string resolveFragShader = STRINGIFY
+    (
+     uniform sampler2DRect tex;
+     uniform sampler2DRect historyTex;
+     uniform sampler2DRect texVelocity;
+     uniform bool historyValid;
+     uniform float blend;
+     uniform float depthThreshold;
+     uniform bool neighbourhoodClamp;
+
+     void main() {
+         vec2 uv = gl_TexCoord[0].xy;
+         vec4 current = texture2DRect(tex, uv);
+         float depth = gbufferLinearDepth(uv);
+
+         // bounds of the colors the history may take here, the texels past the viewport are left from larger frames
+         vec3 minColor = current.rgb;
+         vec3 maxColor = current.rgb;
+         for (int y = -1; y <= 1; ++y) {
+             for (int x = -1; x <= 1; ++x) {
+                 vec3 c = texture2DRect(tex, clamp(uv + vec2(x, y), vec2(0.5), u_cameraViewport.zw - vec2(0.5))).rgb;
+                 minColor = min(minColor, c);
+                 maxColor = max(maxColor, c);
+             }
+         }
+
+         vec3 color = current.rgb;
+         vec2 prevUv = uv - gbufferDecodeVelocity(texture2DRect(texVelocity, uv).xy, u_cameraViewport.zw);
+         bool onScreen = all(greaterThanEqual(prevUv, vec2(0.0))) && all(lessThanEqual(prevUv, u_cameraViewport.zw));
+         if (historyValid && onScreen) {
+             vec4 history = texture2DRect(historyTex, clamp(prevUv, vec2(0.5), u_cameraViewport.zw - vec2(0.5)));
+             // another surface was seen there, e.g. one that moved away from in front
+             bool disoccluded = abs(history.a - depth) > depthThreshold * max(depth, history.a);
+             if (!disoccluded) {
+                 vec3 h = neighbourhoodClamp ? clamp(history.rgb, minColor, maxColor) : history.rgb;
+                 color = mix(h, current.rgb, blend);
+             }
+         }
+         gl_FragColor = vec4(color, depth);
+     }
+     );
+
+    // the history with the alpha of the current frame
+    string copyFragShader = STRINGIFY
+    (
+     uniform sampler2DRect tex;
+     uniform sampler2DRect historyTex;
+     void main() {
+         vec2 uv = gl_TexCoord[0].xy;
+         gl_FragColor = vec4(texture2DRect(historyTex, uv).rgb, texture2DRect(tex, uv).a);
+     }
+     );
+
+    setupShader(resolveShader, sourcesWithHeader(GBuffer::getShaderSource() + resolveFragShader));
+    setupShader(copyShader, sourcesWithHeader(copyFragShader));
+}
+
+void TemporalAccumulationPass::update(ofCamera& cam)
+{
+    // the velocity doesn't lead back across a cut
+    unsigned cuts = getCameraData(cam).getCutCount();
+    if (cuts != cutCount) {
+        historyValid = false;
+        cutCount = cuts;
+    }
+}
+
+void TemporalAccumulationPass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    // the velocity is in pixels of this frame
+    if (size != historySize) {
+        historyValid = false;
+    }
+
+    ofFbo& readHistory = history[currentHistory];
+    ofFbo& writeHistory = history[1 - currentHistory];
+
+    writeHistory.begin();
+    resolveShader.begin();
+    resolveShader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    resolveShader.setUniformTexture("historyTex", readHistory.getTextureReference(), 1);
+    resolveShader.setUniformTexture("texVelocity", gbuffer.getTexture(GBuffer::TYPE_VELOCITY), 2);
+    gbuffer.setShaderUniforms(resolveShader, 3);
+    resolveShader.setUniform1i("historyValid", historyValid);
+    resolveShader.setUniform1f("blend", ofClamp(blend, 0, 1));
+    resolveShader.setUniform1f("depthThreshold", depthThreshold);
+    resolveShader.setUniform1i("neighbourhoodClamp", neighbourhoodClamp);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    resolveShader.end();
+    writeHistory.end();
+
+    writeFbo.begin();
+    copyShader.begin();
+    copyShader.setUniformTexture("tex", readFbo.getTextureReference(), 0);
+    copyShader.setUniformTexture("historyTex", writeHistory.getTextureReference(), 1);
+    texturedQuad(0, 0, size.x, size.y, size.x, size.y);
+    copyShader.end();
+    writeFbo.end();
+
+    currentHistory = 1 - currentHistory;
+    historySize = size;
+    historyValid = true;
+}
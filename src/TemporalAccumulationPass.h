@@ -0,0 +1,63 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#pragma once
+#include "ofMain.h"
+#include "Processor.h"
+
+namespace DeferredEffect {
+    // Blends every frame into a history reprojected with the g buffer velocity,
+    // so jittered passes with few samples converge over a few frames. The history
+    // is clamped to the 3x3 neighbourhood of the current frame against ghosting
+    // and dropped where the linear depth it saw differs, i.e. at disocclusions.
+    // Use with Processor::setJitterEnabled() and late in the chain, after the
+    // passes it should converge.
+    class TemporalAccumulationPass : public RenderPass {
+    public:
+        typedef shared_ptr<TemporalAccumulationPass> Ptr;
+
+        TemporalAccumulationPass(const ofVec2f& sz);
+
+        void update(ofCamera& cam);
+        void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+
+        // weight of the current frame, lower converges over more frames but
+        // trails longer. 0.1 by default
+        float& getBlendRef() { return blend; }
+        float getBlend() const { return blend; }
+        void setBlend(float blend) { this->blend = blend; }
+
+        // relative difference of the linear depth above which the history is
+        // another surface, 0.05 by default
+        float& getDepthThresholdRef() { return depthThreshold; }
+        float getDepthThreshold() const { return depthThreshold; }
+        void setDepthThreshold(float depthThreshold) { this->depthThreshold = depthThreshold; }
+
+        // clamp the history to the neighbourhood of the current frame, on by default
+        bool& getNeighbourhoodClampRef() { return neighbourhoodClamp; }
+        bool getNeighbourhoodClamp() const { return neighbourhoodClamp; }
+        void setNeighbourhoodClamp(bool neighbourhoodClamp) { this->neighbourhoodClamp = neighbourhoodClamp; }
+
+        // starts over from the next frame, e.g. when the scene jumps. CameraData::cut()
+        // and a change of the render size also drop the history.
+        void reset() { historyValid = false; }
+
+    private:
+        ofShader resolveShader;
+        ofShader copyShader;
+        // RGBA16F : accumulated color, linear depth of the frame in alpha.
+        // history[currentHistory] holds the last frame.
+        ofFbo history[2];
+        int currentHistory;
+        bool historyValid;
+        // render size of the last frame, the Processor's resolution scale may change
+        ofVec2f historySize;
+        // CameraData::getCutCount() the history was started at
+        unsigned cutCount;
+
+        float blend;
+        float depthThreshold;
+        bool neighbourhoodClamp;
+    };
+}
@@ -0,0 +1,149 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "ThreadPool.h"
+
+using namespace DeferredEffect;
+
+// the pool and worker the calling thread belongs to, if any
+static thread_local const ThreadPool* currentPool = NULL;
+static thread_local int currentWorker = -1;
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+void ThreadPool::setup(int numThreads)
+{
+    stop();
+    if (numThreads <= 0) {
+        numThreads = max<int>(thread::hardware_concurrency(), 1);
+    }
+    running = true;
+    for (int i = 0; i < numThreads; ++i) {
+        workers.push_back(unique_ptr<Worker>(new Worker()));
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        workers[i]->t = thread(&ThreadPool::run, this, i);
+    }
+}
+
+void ThreadPool::stop()
+{
+    if (!running) return;
+    {
+        lock_guard<mutex> guard(wakeLock);
+        running = false;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker->t.join();
+    }
+    workers.clear();
+    numQueued = 0;
+}
+
+int ThreadPool::getCurrentWorkerIndex() const
+{
+    return currentPool == this ? currentWorker : -1;
+}
+
+void ThreadPool::submit(const Task& task)
+{
+    if (workers.empty()) {
+        task();
+        return;
+    }
+    // workers keep what they spawn, everybody else spreads round robin
+    int index = getCurrentWorkerIndex();
+    if (index < 0) {
+        index = nextQueue++ % workers.size();
+    }
+    {
+        lock_guard<mutex> guard(workers[index]->lock);
+        workers[index]->tasks.push_back(task);
+    }
+    {
+        lock_guard<mutex> guard(wakeLock);
+        ++numQueued;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::pop(int index, Task& task, bool own)
+{
+    Worker& worker = *workers[index];
+    lock_guard<mutex> guard(worker.lock);
+    if (worker.tasks.empty()) return false;
+    if (own) {
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+    } else {
+        task = worker.tasks.front();
+        worker.tasks.pop_front();
+    }
+    --numQueued;
+    return true;
+}
+
+bool ThreadPool::runOne(int index)
+{
+    Task task;
+    bool found = index >= 0 && pop(index, task, true);
+    for (int i = 0; !found && i < workers.size(); ++i) {
+        int victim = (max(index, 0) + 1 + i) % workers.size();
+        found = victim != index && pop(victim, task, false);
+    }
+    if (found) {
+        task();
+    }
+    return found;
+}
+
+void ThreadPool::run(int index)
+{
+    currentPool = this;
+    currentWorker = index;
+    while (true) {
+        if (runOne(index)) continue;
+        unique_lock<mutex> guard(wakeLock);
+        wake.wait(guard, [this] { return numQueued > 0 || !running; });
+        if (!running) break;
+    }
+}
+
+void ThreadPool::parallelFor(int begin, int end, const function<void(int)>& fn)
+{
+    if (end <= begin) return;
+    if (workers.empty() || end - begin == 1) {
+        for (int i = begin; i < end; ++i) fn(i);
+        return;
+    }
+
+    atomic<int> remaining(end - begin);
+    for (int i = begin; i < end; ++i) {
+        submit([&fn, &remaining, i] {
+            fn(i);
+            --remaining;
+        });
+    }
+    int index = getCurrentWorkerIndex();
+    while (remaining > 0) {
+        if (!runOne(index)) {
+            this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::parallelForTiles(int w, int h, int tileSize, const function<void(int, int, int, int)>& fn)
+{
+    int tilesX = (w + tileSize - 1) / tileSize;
+    int tilesY = (h + tileSize - 1) / tileSize;
+    parallelFor(0, tilesX * tilesY, [&](int t) {
+        int x0 = (t % tilesX) * tileSize;
+        int y0 = (t / tilesX) * tileSize;
+        fn(x0, y0, min(x0 + tileSize, w), min(y0 + tileSize, h));
+    });
+}
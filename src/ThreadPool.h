@@ -0,0 +1,53 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+#pragma once
+#include "ofMain.h"
+#include <atomic>
+#include <condition_variable>
+
+namespace DeferredEffect {
+
+    // Fixed set of workers, each with its own task deque. A worker pops its own
+    // newest task and steals the oldest one of the others when it runs dry.
+    // Threads that wait in parallelFor() help out instead of blocking.
+    class ThreadPool {
+    public:
+        typedef function<void()> Task;
+
+        ThreadPool() : running(false), numQueued(0), nextQueue(0) {}
+        ~ThreadPool();
+
+        // 0 means one worker per hardware thread
+        void setup(int numThreads = 0);
+        void stop();
+        int getNumThreads() const { return workers.size(); }
+
+        void submit(const Task& task);
+
+        // calls fn(i) for every i in [begin, end) and returns when all are done
+        void parallelFor(int begin, int end, const function<void(int)>& fn);
+        // calls fn(x0, y0, x1, y1) for every tileSize square of a w x h image
+        void parallelForTiles(int w, int h, int tileSize, const function<void(int, int, int, int)>& fn);
+
+    private:
+        struct Worker {
+            mutex lock;
+            deque<Task> tasks;
+            thread t;
+        };
+
+        void run(int index);
+        bool runOne(int index);
+        bool pop(int index, Task& task, bool own);
+        int getCurrentWorkerIndex() const;
+
+        vector<unique_ptr<Worker>> workers;
+        atomic<bool> running;
+        atomic<int> numQueued;
+        atomic<unsigned> nextQueue;
+        mutex wakeLock;
+        condition_variable wake;
+    };
+
+}
@@ -0,0 +1,67 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#include "VignettePass.h"
+#define STRINGIFY(A) #A
+using namespace DeferredEffect;
+
+VignettePass::VignettePass(const ofVec2f& sz) : RenderPass(sz, "VignettePass"),
+    radius(0.8), softness(0.5), strength(0.5)
+{
+    if (backend != BACKEND_GL) return;
+    setupShader(shader, getPointwiseSources());
+}
+
+string VignettePass::getPointwiseSource() const
+{
+    return STRINGIFY
+    (
+     uniform float PASS_radius;
+     uniform float PASS_softness;
+     uniform float PASS_strength;
+
+     vec4 PASS_apply(vec4 color, vec2 texCoord) {
+         float dist = distance(texCoord / u_cameraViewport.zw, vec2(0.5));
+         float v = smoothstep(PASS_radius - PASS_softness, PASS_radius, dist);
+         return vec4(color.rgb * (1.0 - v * PASS_strength), color.a);
+     }
+     );
+}
+
+int VignettePass::setPointwiseUniforms(ofShader& shader, const string& prefix, int textureUnit)
+{
+    shader.setUniform1f(prefix + "radius", radius);
+    shader.setUniform1f(prefix + "softness", max(softness, 1e-4f));
+    shader.setUniform1f(prefix + "strength", ofClamp(strength, 0, 1));
+    return 0;
+}
+
+void VignettePass::render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer)
+{
+    renderPointwise(shader, readFbo, writeFbo, gbuffer);
+}
+
+bool VignettePass::renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool)
+{
+    float edge0 = radius - max(softness, 1e-4f);
+    float s = ofClamp(strength, 0, 1);
+    int w = readPixels.getWidth();
+    int h = readPixels.getHeight();
+    pool.parallelForTiles(w, h, 32, [&](int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const float* in = readPixels.getData() + (y * w + x0) * 4;
+            float* out = writePixels.getData() + (y * w + x0) * 4;
+            for (int x = x0; x < x1; ++x, in += 4, out += 4) {
+                float dist = ofVec2f((x + 0.5f) / w, (y + 0.5f) / h).distance(ofVec2f(0.5, 0.5));
+                float t = ofClamp((dist - edge0) / (radius - edge0), 0, 1);
+                float scale = 1 - t * t * (3 - 2 * t) * s;
+                for (int ch = 0; ch < 3; ++ch) {
+                    out[ch] = in[ch] * scale;
+                }
+                out[3] = in[3];
+            }
+        }
+    });
+    return true;
+}
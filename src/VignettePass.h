@@ -0,0 +1,48 @@
+//
+// Created by Yuya Hanai, https://github.com/hanasaan
+//
+
+#pragma once
+#include "ofMain.h"
+#include "Processor.h"
+
+namespace DeferredEffect {
+    // Darkens towards the corners of the rendered area. Point-wise, so Processor
+    // draws it in one shader with the point-wise passes next to it.
+    class VignettePass : public RenderPass {
+    public:
+        typedef shared_ptr<VignettePass> Ptr;
+
+        VignettePass(const ofVec2f& sz);
+
+        void update(ofCamera& cam) {}
+        void render(ofFbo& readFbo, ofFbo& writeFbo, GBuffer& gbuffer);
+        bool renderCpu(const ofFloatPixels& readPixels, ofFloatPixels& writePixels, const CpuGBuffer& gbuffer, ThreadPool& pool);
+
+        bool isPointwise() const { return true; }
+        string getPointwiseSource() const;
+        int setPointwiseUniforms(ofShader& shader, const string& prefix, int textureUnit);
+
+        // distance from the center, in units of the width and height, where the
+        // darkening ends. 0.8 by default
+        float& getRadiusRef() { return radius; }
+        float getRadius() const { return radius; }
+        void setRadius(float radius) { this->radius = radius; }
+
+        // distance over which it fades in, 0.5 by default
+        float& getSoftnessRef() { return softness; }
+        float getSoftness() const { return softness; }
+        void setSoftness(float softness) { this->softness = softness; }
+
+        // 0 leaves the color, 1 is black past the radius. 0.5 by default
+        float& getStrengthRef() { return strength; }
+        float getStrength() const { return strength; }
+        void setStrength(float strength) { this->strength = strength; }
+
+    private:
+        ofShader shader;
+        float radius;
+        float softness;
+        float strength;
+    };
+}
@@ -4,6 +4,9 @@
 #include "MotionBlurPass.h"
 #include "DofPass.h"
 #include "DeferredLightingPass.h"
+#include "TemporalAccumulationPass.h"
+#include "ColorGradePass.h"
+#include "VignettePass.h"
 
 namespace ofxDeferred = DeferredEffect;
 typedef ofxDeferred::Processor ofxDeferredProcessing;